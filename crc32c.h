@@ -0,0 +1,110 @@
+#ifndef CRC32C_H
+#define CRC32C_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+// CRC32C (Castagnoli), using the SSE4.2 crc32 instruction when the cpu has
+// it and slicing by 8 tables otherwise
+
+#define CRC32C_POLY 0x82f63b78
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+static uint32_t crc32c_table[8][256];
+static bool crc32c_hw;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void) {
+    uint32_t i, j, c;
+
+    for (i=0; i < 256; i++) {
+        c = i;
+        for (j=0; j < 8; j++) {
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc32c_table[0][i] = c;
+    }
+    for (i=0; i < 256; i++) {
+        for (j=1; j < 8; j++) {
+            c = crc32c_table[j - 1][i];
+            crc32c_table[j][i] = (c >> 8) ^ crc32c_table[0][c & 0xff];
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len && ((uintptr_t) p & 7)) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = crc32c_table[7][v & 0xff] ^
+            crc32c_table[6][(v >> 8) & 0xff] ^
+            crc32c_table[5][(v >> 16) & 0xff] ^
+            crc32c_table[4][(v >> 24) & 0xff] ^
+            crc32c_table[3][(v >> 32) & 0xff] ^
+            crc32c_table[2][(v >> 40) & 0xff] ^
+            crc32c_table[1][(v >> 48) & 0xff] ^
+            crc32c_table[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c;
+
+    while (len && ((uintptr_t) p & 7)) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+        len--;
+    }
+
+    c = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t) c;
+
+    while (len--) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+// Continue crc over buf, pass 0 to start
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc32c_hw) {
+        return ~crc32c_sse42(crc, (const unsigned char *) buf, len);
+    }
+#endif
+    return ~crc32c_sw(crc, (const unsigned char *) buf, len);
+}
+
+#endif
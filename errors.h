@@ -3,5 +3,10 @@
 
 // All error definitions should go here
 
+#define LIGHTKV_ERR_CHECKSUM 1 // A record failed its checksum
+#define LIGHTKV_ERR_VERSION  2 // Data files are of another format version
+#define LIGHTKV_ERR_WAL      3 // The write ahead log could not be written
+#define LIGHTKV_ERR_WRITE    4 // A data file could not be written
+
 
 #endif
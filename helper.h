@@ -5,21 +5,33 @@
 #include <stdlib.h>
 #include <string.h>
 #include "logger.h"
+#include "lz.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define DATAFILE_FORMATSTR  "data.%d.db"
+#define WALFILE_FORMATSTR   "wal.%d.log"
+#define SUPERFILE           "super.db"
+#define SUPERFILE_TMP       "super.db.tmp"
+#define DICTFILE_FORMATSTR  "dict.%d.db"
+#define DICTFILE_TMP        "dict.db.tmp"
 
 #define LOCSTR "%"PRIu64" (%d:%d,%d)"
 #define LOCPARAMS(x) x.val,x.l.num,x.l.offset,x.l.sclass
 
 char *joinpath(const char *base, const char *next);
 char *getfilepath(const char *base, int n) ;
+char *getwalpath(const char *base, int n) ;
 void print_buf(const char *buf, int len) ;
 inline void print_record(record *rec) ;
 uint32_t roundsize(uint32_t v) ;
 size_t get_val(record *r, char **v) ;
 char *get_key(record *r) ;
+uint32_t val_offset(const record *r);
 int get_sizeslot(uint32_t v) ;
 uint32_t get_slotsize(int slot);
+bool prefix_match(const char *key, uint32_t readable, uint8_t keylen, const char *prefix, uint8_t plen);
 
 char *joinpath(const char *base, const char *next) {
     size_t l1,l2;
@@ -47,6 +59,12 @@ char *getfilepath(const char *base, int n) {
     return joinpath(base, name);
 }
 
+char *getwalpath(const char *base, int n) {
+    char name[200];
+    snprintf(name, 200, WALFILE_FORMATSTR, n);
+    return joinpath(base, name);
+}
+
 void print_buf(const char *buf, int len) {
     int i;
     printf("%p: ", buf);
@@ -58,10 +76,10 @@ void print_buf(const char *buf, int len) {
 
 inline void print_record(record *rec) {
     char key[rec->extlen+1];
-    char val[rec->len - rec->extlen - RECORD_HEADER_SIZE];
+    char val[rec->len - val_offset(rec)];
     strncpy(key, (char *) rec + RECORD_HEADER_SIZE, rec->extlen);
     key[rec->extlen] = '\0';
-    strncpy(val, (char *) rec + RECORD_HEADER_SIZE + rec->extlen, sizeof(val));
+    strncpy(val, (char *) rec + val_offset(rec), sizeof(val));
 
     debug_log("Record: type:%d size:%d keylen:%d key:%s val:%s",
             rec->type,
@@ -109,6 +127,7 @@ uint32_t get_slotsize(int slot) {
 freeloc *freeloc_new(loc l) {
     freeloc *f = (freeloc *) malloc(sizeof(freeloc));
     f->l = l;
+    f->epoch = 0;
     f->next = NULL;
     f->prev = NULL;
     return f;
@@ -122,10 +141,65 @@ char *get_key(record *r) {
     return buf;
 }
 
+// Bytes of a VAL record before its value, the key and any expiry time
+uint32_t val_offset(const record *r) {
+    return RECORD_HEADER_SIZE + r->extlen + (r->flags & RECORD_EXPIRES ? sizeof(uint32_t) : 0);
+}
+
+// Does a key of keylen bytes start with prefix? Compares 16 bytes at a time
+// with SSE2. readable bytes may be loaded from key, and prefix is padded
+// with atleast 16 bytes.
+bool prefix_match(const char *key, uint32_t readable, uint8_t keylen, const char *prefix, uint8_t plen) {
+    if (plen > keylen) {
+        return false;
+    }
+#if defined(__SSE2__)
+    uint32_t i = 0;
+    for (; i + 16 <= plen; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (key + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (prefix + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff) {
+            return false;
+        }
+    }
+    if (i == plen) {
+        return true;
+    }
+    if (i + 16 <= readable) {
+        // Compare the rest in one go, ignoring the bytes after it
+        __m128i a = _mm_loadu_si128((const __m128i *) (key + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (prefix + i));
+        uint32_t mask = (1U << (plen - i)) - 1;
+        return (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & mask) == mask;
+    }
+    return memcmp(key + i, prefix + i, plen - i) == 0;
+#else
+    return memcmp(key, prefix, plen) == 0;
+#endif
+}
+
+// Copy out the value, decompressed if need be. *v is NULL if it is corrupt.
 size_t get_val(record *r, char **v) {
-    int l = r->len - RECORD_HEADER_SIZE - r->extlen;
+    int l = r->len - val_offset(r);
+    const char *src = (char *) r + val_offset(r);
+    uint32_t raw;
+
+    if (r->flags & RECORD_COMPRESSED) {
+        if (l < (int) sizeof(raw)) {
+            *v = NULL;
+            return 0;
+        }
+        memcpy(&raw, src, sizeof(raw));
+        *v = raw <= MAX_RECORD_SIZE ? (char *) malloc(raw + 1) : NULL;
+        if (*v && !lz_decompress(src + sizeof(raw), l - sizeof(raw), *v, raw)) {
+            free(*v);
+            *v = NULL;
+        }
+        return *v ? raw : 0;
+    }
+
     char *buf = (char *) malloc(l);
-    memcpy(buf, (char *) r + RECORD_HEADER_SIZE + r->extlen, l);
+    memcpy(buf, src, l);
     *v = buf;
     return l;
 }
@@ -1,7 +1,12 @@
+#define _GNU_SOURCE /* sync_file_range */
 #include "lightkv.h"
 #include <sys/mman.h> /* mmap inside */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h> /* pwritev */
+#include <sched.h>
+#include <time.h> /* clock_gettime */
+#include <limits.h>
 #include <fcntl.h> /* file open modes and stuff */
 #include <assert.h>
 #include <stdlib.h>
@@ -9,11 +14,316 @@
 #include <unistd.h>
 #include <math.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include "helper.h"
+#include "crc32c.h"
 #include "errors.h"
 #include "logger.h"
 #include <unistd.h>
 #include <pthread.h>
+#include <dirent.h>
+
+#define SUPER_MAGIC      0x4b56534d // Changes with the superblock layout
+#define SUPER_MAGIC_V1   0x4b56534c // Layout ending at nexpire, without expiries
+#define DICT_MAGIC       0x4b56444c
+#define WAL_FAILED       UINT64_MAX // lsn of an entry that could not be logged
+
+// Write ahead log entry, followed by len bytes to put at recid
+typedef struct __attribute__((__packed__)) {
+    uint64_t    lsn; // Log sequence number
+    uint64_t    recid;
+    uint32_t    len;
+    uint32_t    rest; // Entries of the same batch following this one
+    uint32_t    check; // Checksum of entry and data
+} walentry;
+
+// Superblock, followed by the recids of free slots when clean and the
+// pending expiries
+typedef struct __attribute__((__packed__)) {
+    uint32_t    magic;
+    uint16_t    version; // Format version of the data files
+    uint16_t    nfiles;
+    uint64_t    end_loc; // End of db, as of the last checkpoint if not clean
+    uint64_t    seqno; // Last change sequence number handed out
+    uint8_t     clean; // Closed cleanly, the free slots are complete
+    uint32_t    counts[MAX_SIZES]; // Free slots per size class
+    uint64_t    freeoff; // Offset of free slot recids in the file
+    uint64_t    nexpire; // Pending expiries after the free slots, as recid and time pairs
+    uint32_t    check; // Checksum of all of the above, free slots and expiries
+} superblock;
+
+// Dictionary file header, followed by len bytes of dictionary
+typedef struct __attribute__((__packed__)) {
+    uint32_t    magic;
+    uint32_t    id;
+    uint32_t    len;
+    uint32_t    check; // Checksum of all of the above and the dictionary
+} dictheader;
+
+// Internal helpers
+
+// Open data file num and publish it to readers
+static void open_datafile(lightkv *kv, uint16_t num);
+
+// Mark the unused space after end in a file which is no longer appended to
+static void seal_datafile(lightkv *kv, loc end);
+
+// Remember offset as a known record start of its grain
+static void mark_recstart(lightkv *kv, uint16_t num, uint32_t offset);
+
+// Write raw bytes into disk, or into the arena buffering that location.
+// Returns len, or -1 with LIGHTKV_ERR_WRITE set.
+static int write_buf(lightkv *kv, loc l, const char *buf, size_t len);
+
+// Write raw bytes straight to the data file, returns len or -1 with
+// LIGHTKV_ERR_WRITE set
+static int write_direct(lightkv *kv, loc l, const char *buf, size_t len);
+
+// Note [offset, offset+len) of file num as written, after the write is done
+static void mark_dirty(lightkv *kv, uint16_t num, uint32_t offset, size_t len);
+
+// Sync the dirty ranges of file num
+static void sync_dirty(lightkv *kv, uint16_t num);
+
+// Read raw bytes straight from a data file, returns bytes read
+static size_t read_direct(lightkv *kv, uint16_t num, uint64_t offset, char *buf, size_t len);
+
+// Arena of the calling thread
+static arena *arena_get(lightkv *kv);
+
+// Replace the chunk of arena with a fresh one from the tail
+static void arena_newchunk(lightkv *kv, arena *a);
+
+// Give up the rest of the chunk of arena and flush it
+static void arena_retire(lightkv *kv, arena *a);
+
+// Move quarantined slots no reader can still see into the arena cache
+static void arena_reclaim(lightkv *kv, arena *a);
+
+// Place record into a free or tail slot and write it, false if the write
+// failed
+static bool place_record(lightkv *kv, record *rec, loc *l);
+
+// Checksum of a record as stored in its header
+static uint32_t record_crc(const record *rec);
+
+// Does the record match its checksum?
+static bool verify_record(const record *rec);
+
+// Can rh start a record? Checks bounds, and the checksum of markers
+static bool valid_header(const record *rh);
+
+// Zero [offset, offset+len) of data file num
+static void zero_range(lightkv *kv, uint16_t num, uint64_t offset, uint64_t len);
+
+// Should a read of the given LIGHTKV_VERIFY_* kind be verified?
+static bool should_verify(lightkv *kv, int kind);
+
+// Write the format version into a new data file
+static void stamp_datafile(lightkv *kv, uint16_t num);
+
+// Build a VAL record stamped with seqno into a caller provided buffer,
+// expiring at expiry unless it is 0
+static void fill_record(record *rec, const char *key, int keylen, const char *val, size_t len, uint32_t expiry, uint64_t seqno);
+
+// Build a compressed VAL record if that saves a size class, NULL otherwise
+static record *compress_record(lightkv *kv, const char *key, int keylen, const char *val, size_t len, uint32_t expiry, uint64_t seqno);
+
+// Create a VAL record, compressed when worth it
+static record *create_value(lightkv *kv, const char *key, const char *val, size_t len, uint32_t expiry, uint64_t seqno);
+
+// Expiry time of a VAL record, 0 if it has none
+static uint32_t record_expiry(const record *rec);
+
+// Has a VAL record expired?
+static bool record_expired(const record *rec);
+
+// Copy out the value of a VAL record, decompressed against its dictionary
+// if it has one. *v is NULL if it is corrupt.
+static size_t record_value(lightkv *kv, record *rec, char **v);
+
+// Decompress the value of a compressed record into raw bytes at dst, false
+// if it is corrupt
+static bool unpack_value(lightkv *kv, const record *rec, char *dst, uint32_t raw);
+
+// Atomically write dictionary id into its own file
+static int write_dict(lightkv *kv, int id, const char *data, uint32_t len);
+
+// Load the dictionaries of the db directory, the newest becomes active
+static int load_dicts(lightkv *kv);
+
+// Reserve n consecutive change sequence numbers, returns the first
+static uint64_t next_seqno(lightkv *kv, uint64_t n);
+
+// Move the sequence number past one found on disk, given its low 32 bits
+static void note_seqno(lightkv *kv, uint32_t low);
+
+// Add a change of the record at l to the change feed
+static void publish_change(lightkv *kv, uint64_t seqno, loc l, uint8_t type);
+
+#ifdef USE_MMAP
+// Note a use of the region holding offset of file num
+static void mem_touch(lightkv *kv, uint16_t num, uint64_t offset);
+
+// Measure resident pages and advise out cold regions when over budget
+static void governor_pass(lightkv *kv);
+#endif
+
+// Count one in TIER_SAMPLE reads of the calling thread towards the heat of
+// recid, queueing it for the migrator every TIER_HOT counts
+static void tier_sample(lightkv *kv, uint64_t recid);
+
+// Is l within a chunk records were moved into?
+static bool tier_ishot(lightkv *kv, loc l);
+
+// Give up the chunk records are moved into, tierlock held
+static void tier_retire(lightkv *kv);
+
+// Take a fresh chunk from the tail to move records into, tierlock held
+static void tier_newchunk(lightkv *kv);
+
+// Copy the VAL record at l into the current chunk and delete it there,
+// false if l does not hold one or it was written meanwhile. tierlock held.
+static bool tier_move(lightkv *kv, loc l, loc *to);
+
+// Take movelock shared for a write to an existing slot, true if taken.
+// Only while tiering is on; the slot then has to be checked for a VAL.
+static bool tier_hold(lightkv *kv);
+
+// Drop movelock if tier_hold took it
+static void tier_release(lightkv *kv, bool held);
+
+// Put an expiry into its wheel slot, or due if its second has come.
+// wheellock held.
+static void wheel_insert(lightkv *kv, expent *e);
+
+// Move the wheel upto second now, its expiries are then due. wheellock held.
+static void wheel_advance(lightkv *kv, uint32_t now);
+
+// Reclaim the record at l once it is past expiry
+static void expire_add(lightkv *kv, loc l, uint32_t expiry);
+
+// Delete upto max records past their expiry, returns how many. Without
+// wait, gives up if another thread is at it.
+static int expire_step(lightkv *kv, int max, bool wait);
+
+// Copy key and value of a cached VAL record, false on a miss
+static bool cache_get(lightkv *kv, uint64_t recid, char **key, char **val, uint32_t *len);
+
+// Invalidation count of the shard of recid, taken before reading a record
+static uint64_t cache_ticket(lightkv *kv, uint64_t recid);
+
+// Cache a record read from disk, unless recid was invalidated since ticket
+static void cache_put(lightkv *kv, uint64_t recid, const record *rec, uint64_t ticket);
+
+// Drop recid after its slot was written
+static void cache_invalidate(lightkv *kv, uint64_t recid);
+
+// Free all shards of the record cache
+static void cache_free(lightkv *kv);
+
+// Return a loc to its size class freelist
+static void freelist_push(lightkv *kv, loc l);
+
+// Pick a loc from freelist to store record of given size
+static bool take_freeloc(lightkv *kv, size_t size, loc *l);
+
+// Reserve a loc at the end of db to store record of given size
+static loc take_tailloc(lightkv *kv, size_t size);
+
+// Flush arena buffers and sync all data files
+static void sync_files(lightkv *kv);
+
+// Add a log entry, wallock held. rest counts the entries of its batch after it.
+// Returns the lsn, WAL_FAILED if the log could not be written.
+static uint64_t wal_put(lightkv *kv, uint64_t recid, const char *buf, uint32_t len, uint32_t rest);
+
+// Hand buffered entries to the OS, false if the log could not be written
+static bool wal_write(lightkv *kv);
+
+// Give up on the current log after a failed write, wallock held
+static void wal_fail(lightkv *kv);
+
+// Log len bytes written at l, returns the lsn, 0 without a log or
+// WAL_FAILED if the log could not be written
+static uint64_t wal_append(lightkv *kv, loc l, const char *buf, uint32_t len);
+
+// Make the log durable upto lsn as the calling thread asks for, false if
+// that failed
+static bool wal_commit(lightkv *kv, uint64_t lsn);
+
+// Start a new log, the old one goes once the data files are synced
+static int wal_switch(lightkv *kv);
+
+// Apply log generation gen to the data files, returns entries replayed or
+// -1 if a data file could not be written
+static int wal_replay(lightkv *kv, int gen, uint64_t *lastlsn);
+
+// Replay and drop logs of an earlier run at open, returns entries replayed.
+// Logs are kept when that fails, -1.
+static int wal_recover(lightkv *kv);
+
+// Move end of db past a slot of the given size at l
+static void extend_end(lightkv *kv, loc l, uint32_t size);
+
+// Atomically replace the superblock recording end, with free slots when clean
+static int write_super(lightkv *kv, loc end, bool clean);
+
+// Write all of buf to fd
+static bool write_all(int fd, const void *buf, size_t len);
+
+// Restore state from the superblock at open, returns -1 without one.
+// Superblocks of the earlier layout are read too.
+static int load_super(lightkv *kv);
+
+// Scan data files from a location onward and merge what was found
+static int recover_from(lightkv *kv, loc from, int nthreads);
+
+// Write the DEL record of a slot and quarantine it, returns the lsn or
+// WAL_FAILED
+static uint64_t delete_slot(lightkv *kv, loc l);
+
+// Write the DEL record of a slot without freeing it, false if the write
+// failed. lsn is set either way, WAL_FAILED when nothing was logged.
+static bool tombstone_slot(lightkv *kv, loc l, uint64_t *lsn);
+
+// Quarantine a deleted slot till concurrent readers are done with it
+static void retire_slot(lightkv *kv, loc l);
+
+// Make the log durable upto lsn at the given level, false if that failed
+static bool wal_flush(lightkv *kv, uint64_t lsn, int level);
+
+// Log the images of a batch as one group, returns the lsn of the last or
+// WAL_FAILED
+static uint64_t wal_append_batch(lightkv *kv, batchop *ops, size_t n);
+
+// Is the batch logged at offset of fd complete? Torn batches are dropped.
+static bool wal_batch_complete(int fd, uint64_t offset, const walentry *e);
+
+// Does one of the n ops put a record at l?
+static bool batch_fresh(const batchop *ops, size_t n, loc l);
+
+// Write the images of a batch, adjacent slots in one vectored write. False
+// if some could not be written.
+static bool batch_apply(lightkv *kv, batchop *ops, size_t n);
+
+// Move an iterator on to the next file at the end of one, false when
+// its range is done
+static bool iter_settle(lightkv_iter *iter);
+
+// Bytes [cursor, cursor+len) of an iterator, from its read window or the
+// mapping, NULL if they do not fit a window. Valid till the next call.
+static const char *iter_window(lightkv_iter *iter, uint32_t len);
+
+// Length of the zeros in whole headers at the cursor of an iterator, within
+// len bytes at p, when it is below the end of db. Unused space left in
+// the chunks of arenas reads as zeros and is stepped over; past the end
+// of db they end a scan.
+static uint64_t iter_zeros(lightkv_iter *iter, const char *p, uint64_t len);
+
+// Does a VAL record pass the prefix and filter of an iterator? readable
+// bytes from its key may be loaded. Damaged values pass, to be reported.
+static bool iter_match(lightkv_iter *iter, const record *rec, uint32_t readable);
 
 freeloc *freelist_add(freeloc *head, freeloc *n) {
     if (head) {
@@ -43,6 +353,10 @@ freeloc *freelist_get(freeloc *head, uint32_t size) {
                 f = head;
             }
         }
+        // Nothing fits better than an exact slot
+        if (diff == 0) {
+            break;
+        }
         head = head->next;
     }
 
@@ -118,380 +432,4483 @@ int map_file(void **map, const char *filepath) {
     return 0;
 }
 
-int init_file(int *fd, const char *filepath) {
-    *fd = open(filepath, O_RDWR | O_CREAT | O_TRUNC, 0644);
-    return 0;
+#ifndef USE_MMAP
+static int init_file(int *fd, const char *filepath) {
+    *fd = open(filepath, O_RDWR | O_CREAT, 0644);
+    return *fd < 0 ? -1 : 0;
 }
+#endif
 
-loc create_nextloc(lightkv *kv, uint32_t size) {
-    loc next = kv->end_loc;
-    next.l.sclass = 0;
-    uint64_t off = kv->end_loc.l.offset + size + 2;
-    if (off > MAX_FILESIZE) {
-        // FIXME: in prealloc, its different.
-
-        next.l.num++;
-        next.l.offset = 1;
-        kv->nfiles++;
+// Largest free slot that fits in len bytes
+static uint32_t free_piece(uint32_t len) {
+    uint32_t piece = get_slotsize(MAX_SIZES - 1);
+    while (piece > len) {
+        piece >>= 1;
+    }
+    return piece;
+}
 
-        assert(next.l.num <= MAX_NFILES);
-        char *f = (char *) getfilepath(kv->basepath, next.l.num);
+// Open data file num and publish it to readers
+static void open_datafile(lightkv *kv, uint16_t num) {
+    assert(num < MAX_NFILES);
+    char *f = (char *) getfilepath(kv->basepath, num);
 
 #ifdef USE_MMAP
-        alloc_file(f, MAX_FILESIZE);
+    alloc_file(f, MAX_FILESIZE);
 
-        if (map_file(&kv->filemaps[next.l.num], f) < 0) {
-            assert(false);
-        }
+    if (map_file(&kv->filemaps[num], f) < 0) {
+        assert(false);
+    }
 #else
-        if (init_file(&kv->fds[next.l.num], f) < 0) {
-            assert(false);
-        }
+    if (init_file(&kv->fds[num], f) < 0) {
+        assert(false);
+    }
 #endif
-        free(f);
-        // Put this space to freelist
-        uint32_t remaining = MAX_FILESIZE - (kv->end_loc.l.offset + 1);
-        if (remaining >= RECORD_HEADER_SIZE) {
-            loc rm;
-            rm.l.num = kv->end_loc.l.num;
-            rm.l.offset = kv->end_loc.l.offset + 1;
-            rm.l.sclass = get_sizeslot(roundsize(remaining));
-            // cannot find a suitable bucket
-            // Place an end pointer
-            // FIXME: split remaining into maximum free buckets
-            if (get_slotsize(rm.l.sclass) > remaining) {
-                record rh;
-                rh.type = RECODE_END;
-                rh.len = remaining;
-                write_record(kv, rm, (record *) &rh);
-            } else {
-                lightkv_delete(kv, rm.val);
+    free(f);
+    stamp_datafile(kv, num);
+
+    __atomic_store_n(&kv->nfiles, num + 1, __ATOMIC_RELEASE);
+}
+
+static void stamp_datafile(lightkv *kv, uint16_t num) {
+    loc l;
+    uint8_t version = LIGHTKV_FORMAT_VERSION;
+
+    l.val = 0;
+    l.l.num = num;
+    write_direct(kv, l, (char *) &version, 1);
+}
+
+// Mark the unused space after end in a file which is no longer appended to
+static void seal_datafile(lightkv *kv, loc end) {
+    // Put this space to freelist
+    uint32_t remaining = MAX_FILESIZE - (end.l.offset + 1);
+    if (remaining >= RECORD_HEADER_SIZE) {
+        loc rm;
+        rm.l.num = end.l.num;
+        rm.l.offset = end.l.offset + 1;
+        rm.l.sclass = get_sizeslot(roundsize(remaining));
+        // cannot find a suitable bucket
+        // Place an end pointer
+        // FIXME: split remaining into maximum free buckets
+        if (get_slotsize(rm.l.sclass) > remaining) {
+            record rh;
+            memset(&rh, 0, sizeof(rh));
+            rh.type = RECODE_END;
+            rh.len = remaining;
+            rh.crc = record_crc(&rh);
+            write_buf(kv, rm, (char *) &rh, RECORD_HEADER_SIZE);
+        } else {
+            lightkv_delete(kv, rm.val);
+        }
+    }
+}
+
+static void mark_recstart(lightkv *kv, uint16_t num, uint32_t offset) {
+    uint32_t *mark = &kv->splits[num][offset / SPLIT_GRAIN];
+    uint32_t unknown = 0;
+
+    if (__atomic_load_n(mark, __ATOMIC_RELAXED) == 0) {
+        __atomic_compare_exchange_n(mark, &unknown, offset, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
+
+// Tail is reserved by advancing end_loc with a CAS. Only the rollover into
+// a new file takes a lock, to create the file exactly once.
+loc create_nextloc(lightkv *kv, uint32_t size) {
+    loc cur, next;
+
+    cur.val = __atomic_load_n(&kv->end_loc.val, __ATOMIC_ACQUIRE);
+    while (1) {
+        next = cur;
+        next.l.sclass = 0;
+        if ((uint64_t) cur.l.offset + size + 2 > MAX_FILESIZE) {
+            // FIXME: in prealloc, its different.
+            pthread_mutex_lock(&kv->filelock);
+            if (__atomic_load_n(&kv->nfiles, __ATOMIC_ACQUIRE) <= cur.l.num + 1) {
+                open_datafile(kv, cur.l.num + 1);
             }
+            pthread_mutex_unlock(&kv->filelock);
 
+            next.l.num++;
+            next.l.offset = 1;
+        } else {
+            next.l.offset++;
+        }
+
+        loc end = next;
+        end.l.offset += size - 1;
+        if (__atomic_compare_exchange_n(&kv->end_loc.val, &cur.val, end.val,
+                    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
         }
-    } else {
-       next.l.offset++;
     }
 
+    // Winner of the rollover owns the leftover space of the previous file
+    if (next.l.num != cur.l.num) {
+        seal_datafile(kv, cur);
+    }
+
+    // Every reservation begins a record
+    mark_recstart(kv, next.l.num, next.l.offset);
+
     return next;
 }
 
-int write_record(lightkv *kv, loc l, record *rec) {
+// Returns len, or -1 with LIGHTKV_ERR_WRITE set
+static int write_direct(lightkv *kv, loc l, const char *buf, size_t len) {
 #ifdef USE_MMAP
     char *dst;
     dst = (char *) kv->filemaps[l.l.num] + l.l.offset;
-    memcpy(dst, rec, rec->len);
+    memcpy(dst, buf, len);
+    mem_touch(kv, l.l.num, l.l.offset);
 #else
-    lseek(kv->fds[l.l.num], l.l.offset, SEEK_SET);
-    write(kv->fds[l.l.num], rec, rec->len);
-#endif
-
-    return rec->len;
-}
-
-int read_record(lightkv *kv, loc l, record **rec) {
-    size_t slotsize = get_slotsize(l.l.sclass);
-    *rec = (record *) malloc(slotsize);
-#ifdef USE_MMAP
-    char *src;
-    src = (char *) kv->filemaps[l.l.num] + l.l.offset;
-    memcpy(*rec, src, slotsize);
-#else
-    lseek(kv->fds[l.l.num], l.l.offset, SEEK_SET);
-    read(kv->fds[l.l.num], (char *) *rec, slotsize);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(kv->fds[l.l.num], buf + done, len - done, l.l.offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            debug_log("Operation:Write, %zu bytes at target:"LOCSTR" failed: %s", len, LOCPARAMS(l), strerror(errno));
+            mark_dirty(kv, l.l.num, l.l.offset, len);
+            kv->error = LIGHTKV_ERR_WRITE;
+            return -1;
+        }
+        done += n;
+    }
 #endif
+    mark_dirty(kv, l.l.num, l.l.offset, len);
 
-    return 0;
+    return len;
 }
 
-record read_recheader(lightkv *kv, loc l) {
-    record rh;
-#ifdef USE_MMAP
-    char *src = (char *) kv->filemaps[l.l.num] + l.l.offset;
-    memcpy((char *) &rh, src, sizeof(rh));
-#else
-    lseek(kv->fds[l.l.num], l.l.offset, SEEK_SET);
-    read(kv->fds[l.l.num], (char *) &rh, sizeof(rh));
-#endif
+static void mark_dirty(lightkv *kv, uint16_t num, uint32_t offset, size_t len) {
+    uint32_t g, last = (offset + len - 1) / DIRTY_GRAIN;
+    uint64_t *words = kv->dirty[num];
 
-    return rh;
+    for (g = offset / DIRTY_GRAIN; g <= last; g++) {
+        uint64_t bit = 1ULL << (g % 64);
+        if (!(__atomic_load_n(&words[g / 64], __ATOMIC_RELAXED) & bit)) {
+            __atomic_fetch_or(&words[g / 64], bit, __ATOMIC_RELEASE);
+        }
+    }
 }
 
-int lightkv_init(lightkv **kv, const char *base, bool prealloc) {
-    // TODO: Add sanity checks
+// Grains are cleared before they are flushed, so a write landing meanwhile
+// marks its grain again and goes out with the next sync.
+static void sync_dirty(lightkv *kv, uint16_t num) {
+    uint64_t *words = kv->dirty[num];
+    uint64_t start = 0, end = 0;
+    bool dirty = false;
+    uint32_t w, b;
 
-    *kv = (lightkv *) malloc(sizeof(lightkv));
+    for (w=0; w <= DIRTY_WORDS; w++) {
+        uint64_t bits = 0;
+        if (w < DIRTY_WORDS && __atomic_load_n(&words[w], __ATOMIC_RELAXED)) {
+            bits = __atomic_exchange_n(&words[w], 0, __ATOMIC_ACQ_REL);
+        }
+        if (bits == 0 && end == start && w < DIRTY_WORDS) {
+            continue;
+        }
 
-    (*kv)->prealloc = prealloc;
-    (*kv)->basepath = strdup(base);
+        for (b=0; b < 64; b++) {
+            uint64_t grain = (uint64_t) w * 64 + b;
+            if (bits & (1ULL << b)) {
+                if (end != grain * DIRTY_GRAIN) {
+                    start = grain * DIRTY_GRAIN;
+                }
+                end = (grain + 1) * DIRTY_GRAIN;
+                continue;
+            }
+            if (end > start) {
+                // Range ended, write it out
+                debug_log("Operation:Sync, file %d range %"PRIu64"-%"PRIu64, num, start, end);
 #ifdef USE_MMAP
-    (*kv)->filemaps[0] = NULL;
-#else
-    (*kv)->fds[0] = -1;
+                msync((char *) kv->filemaps[num] + start, end - start, MS_SYNC);
+#elif defined(SYNC_FILE_RANGE_WRITE)
+                sync_file_range(kv->fds[num], start, end - start, SYNC_FILE_RANGE_WRITE);
 #endif
-    (*kv)->nfiles = 1;
+                dirty = true;
+                start = end;
+            }
+            if (w == DIRTY_WORDS) {
+                break;
+            }
+        }
+    }
 
-    int i;
-    for (i=0; i <MAX_SIZES; i++) {
-        (*kv)->freelist[i] = NULL;
+    if (dirty) {
+#ifndef USE_MMAP
+        // Ranges are only queued above, wait for them and the file size
+        fdatasync(kv->fds[num]);
+#endif
+        debug_log("Operation:Sync, file %d done", num);
     }
+}
 
-    char *f = getfilepath(base, 0);
-    if (access(f, F_OK ) != -1) {
-        int num = 0;
-        char *fn;
-        (*kv)->has_scanned = false;
+// Per thread allocation arenas
+//
+// Every writer thread owns an arena. It reserves chunks of the append region
+// and carves tail slots out of them, and keeps the slots it frees in per
+// size class caches. An insert normally only touches the arena of the calling
+// thread. With write buffering enabled the arena also holds an in memory copy
+// of its chunk which goes to disk in large writes.
+//
+// An arena lock is taken uncontended by its owner and by other threads only
+// when they touch the buffered chunk. It is never held while calling into
+// write_buf or create_nextloc, which may lock other arenas.
 
-        while (1) {
-            fn = getfilepath(base, num);
-            if (access(fn, F_OK|R_OK|W_OK) != -1) {
-#ifdef USE_MMAP
-                if (map_file(&(*kv)->filemaps[num], fn) < 0) {
-                    assert(false);
-                }
-#else
-                if (init_file(&(*kv)->fds[num], fn) < 0) {
-                    assert(false);
-                }
-#endif
-                num++;
-                (*kv)->nfiles = num;
-                free(fn);
-            } else {
-                free(fn);
-                break;
-            }
-        }
-    } else {
-        (*kv)->has_scanned = true;
+static arena *arena_get(lightkv *kv) {
+    arena *a = (arena *) pthread_getspecific(kv->arenakey);
+    if (a) {
+        return a;
+    }
 
-#ifdef USE_MMAP
-        alloc_file(f, MAX_FILESIZE);
-        if (map_file(&(*kv)->filemaps[0], f) < 0) {
-            assert(false);
+    pthread_mutex_lock(&kv->arenalock);
+    for (a = kv->arenas; a; a = a->next) {
+        if (!a->inuse) {
+            break;
         }
-#else
-        if (init_file(&(*kv)->fds[0], f) < 0) {
+    }
+
+    if (a == NULL) {
+        if (posix_memalign((void **) &a, ARENA_ALIGN, sizeof(arena))) {
             assert(false);
         }
-#endif
+        memset(a, 0, sizeof(arena));
+        a->kv = kv;
+        a->dirty_lo = UINT32_MAX;
+        a->tierrand = (uint32_t) (uintptr_t) a | 1;
+        pthread_mutex_init(&a->lock, NULL);
+        a->next = kv->arenas;
+        __atomic_store_n(&kv->arenas, a, __ATOMIC_RELEASE);
     }
+    a->inuse = true;
+    a->durability = LIGHTKV_DURABLE_DEFAULT;
+    pthread_mutex_unlock(&kv->arenalock);
 
-    free(f);
-
-    // FIXME: fix loc pointers
-    loc x;
-    x.l.num = 0;
-    x.l.offset = 0;
+    pthread_setspecific(kv->arenakey, a);
+    return a;
+}
 
-    (*kv)->end_loc = x;
-    x.l.offset = 1;
-    (*kv)->start_loc = x;
+// Is [offset, offset+len) of file num within the chunk of arena. Other
+// threads call it without the arena lock and recheck after locking.
+static bool arena_covers(arena *a, uint16_t num, uint64_t offset, size_t len) {
+    loc base;
+    uint32_t cap = __atomic_load_n(&a->cap, __ATOMIC_ACQUIRE);
+    base.val = __atomic_load_n(&a->base.val, __ATOMIC_RELAXED);
+    return cap && base.l.num == num && offset >= base.l.offset &&
+        offset + len <= (uint64_t) base.l.offset + cap;
+}
 
-    return 0;
+static bool arena_overlaps(arena *a, uint16_t num, uint64_t offset, size_t len) {
+    loc base;
+    uint32_t cap = __atomic_load_n(&a->cap, __ATOMIC_ACQUIRE);
+    base.val = __atomic_load_n(&a->base.val, __ATOMIC_RELAXED);
+    return cap && base.l.num == num && offset < (uint64_t) base.l.offset + cap &&
+        offset + len > base.l.offset;
 }
 
-// Create a VAL or DEL record. Pass recsize = 0 for VAL record.
-record *create_record(uint8_t type, const char *key, const char *val, size_t len, size_t recsize) {
-    record *rec = NULL;
+// Write out the dirty part of a buffered chunk, arena lock held
+static void arena_flush(lightkv *kv, arena *a) {
+#ifndef USE_MMAP
+    if (a->dirty_hi > a->dirty_lo) {
+        loc l = a->base;
+        l.l.offset += a->dirty_lo;
+        debug_log("Operation:Flush, %u bytes at target:"LOCSTR, a->dirty_hi - a->dirty_lo, LOCPARAMS(l));
+        // Buffered writes have returned already, a failure is left in kv->error
+        write_direct(kv, l, a->buf + a->dirty_lo, a->dirty_hi - a->dirty_lo);
+    }
+#endif
+    a->dirty_lo = UINT32_MAX;
+    a->dirty_hi = 0;
+}
 
-    if (type == RECORD_VAL) {
-        int keylen = strlen(key);
-        recsize = RECORD_HEADER_SIZE + keylen + len;
-        rec = (record *) calloc(recsize, 1);
-        rec->type = type;
-        rec->len = recsize;
-        rec->extlen = keylen;
-        memcpy((char *) rec + RECORD_HEADER_SIZE, key, keylen);
-        memcpy((char *) rec + RECORD_HEADER_SIZE + keylen, val, len);
-    } else if (type == RECORD_DEL) {
-        rec = (record *) calloc(recsize, 1);
-        rec->type = type;
-        rec->len = recsize;
+// Write into a slot within the chunk of arena, arena lock held
+static int arena_write(lightkv *kv, arena *a, loc l, const char *buf, size_t len) {
+    if (a->buf == NULL) {
+        return write_direct(kv, l, buf, len);
     }
 
-    return rec;
+    uint32_t off = l.l.offset - a->base.l.offset;
+    memcpy(a->buf + off, buf, len);
+    if (off < a->dirty_lo) {
+        a->dirty_lo = off;
+    }
+    if (off + len > a->dirty_hi) {
+        a->dirty_hi = off + len;
+    }
+    return len;
 }
 
-loc find_freeloc(lightkv *kv, size_t size) {
-    loc l;
-    int slot = get_sizeslot(size);
+// Cache a free slot, extra slots go back to the global freelist in bulk.
+// Arena lock held.
+static void arena_cache_push(lightkv *kv, arena *a, loc l) {
+    int slot = l.l.sclass;
+    a->cache[slot] = freelist_add(a->cache[slot], freeloc_new(l));
+    a->ncache[slot]++;
 
-    freeloc *f = freelist_get(kv->freelist[slot], size);
-    if (f) {
-        l = f->l;
-        kv->freelist[slot] = freelist_remove(kv->freelist[slot], f);
-    } else {
-        l = create_nextloc(kv, size);
-        kv->end_loc.l.num = l.l.num;
-        kv->end_loc.l.offset = l.l.offset + size - 1;
+    if (a->ncache[slot] <= ARENA_CACHE_MAX) {
+        return;
     }
-    l.l.sclass = slot;
 
-    return l;
-}
+    // Keep the recently freed half, hand over the rest
+    freeloc *f = a->cache[slot];
+    int i;
+    for (i=1; i < ARENA_CACHE_MAX / 2; i++) {
+        f = f->next;
+    }
+    freeloc *rest = f->next;
+    f->next = NULL;
+    rest->prev = NULL;
+    a->ncache[slot] = ARENA_CACHE_MAX / 2;
 
-uint64_t lightkv_insert(lightkv *kv, const char *key, const char *val, uint32_t len) {
-    debug_log("Operation:Insert, key:%s vallen:%d", key, len);
-    loc diskloc;
+    freeloc *last = rest;
+    while (last->next) {
+        last = last->next;
+    }
 
-    record *rec = create_record(RECORD_VAL, key, val, len, 0);
-    int rsize = roundsize(rec->len);
-    diskloc = find_freeloc(kv, rsize);
-    write_record(kv, diskloc, rec);
+    pthread_mutex_lock(&kv->freelocks[slot]);
+    last->next = kv->freelist[slot];
+    if (last->next) {
+        last->next->prev = last;
+    }
+    __atomic_store_n(&kv->freelist[slot], rest, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&kv->freelocks[slot]);
+}
+
+// Move some free slots of a class from the global freelist into the arena
+static int arena_refill(lightkv *kv, arena *a, int slot) {
+    int n = 0;
+
+    if (__atomic_load_n(&kv->freelist[slot], __ATOMIC_RELAXED) == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&kv->freelocks[slot]);
+    freeloc *head = kv->freelist[slot], *f = head;
+    if (f) {
+        n = 1;
+        while (f->next && n < ARENA_CACHE_MAX / 2) {
+            f = f->next;
+            n++;
+        }
+        __atomic_store_n(&kv->freelist[slot], f->next, __ATOMIC_RELAXED);
+        if (f->next) {
+            f->next->prev = NULL;
+        }
+    }
+    pthread_mutex_unlock(&kv->freelocks[slot]);
+
+    if (n) {
+        pthread_mutex_lock(&a->lock);
+        f->next = a->cache[slot];
+        if (f->next) {
+            f->next->prev = f;
+        }
+        a->cache[slot] = head;
+        a->ncache[slot] += n;
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    return n;
+}
+
+// Take a slot of rsize from the cache or the chunk of arena, arena lock held
+static bool arena_take(arena *a, uint32_t rsize, loc *l) {
+    int slot = get_sizeslot(rsize);
+
+    if (a->cache[slot]) {
+        freeloc *f = a->cache[slot];
+        *l = f->l;
+        a->cache[slot] = freelist_remove(f, f);
+        a->ncache[slot]--;
+    } else if (a->cap - a->used >= rsize) {
+        *l = a->base;
+        l->l.offset += a->used;
+        a->used += rsize;
+    } else {
+        return false;
+    }
+
+    l->l.sclass = slot;
+    return true;
+}
+
+// Deleted slots are quarantined in the arena of the deleting thread, tagged
+// with the global epoch. Readers publish the epoch they entered in. A slot is
+// handed out again only once every reader active at the time of its delete
+// has left, i.e. all active readers have a newer epoch.
+static void arena_reclaim(lightkv *kv, arena *a) {
+    arena *r;
+    uint64_t safe;
+
+    if (a->limbo == NULL) {
+        return;
+    }
+
+    safe = __atomic_add_fetch(&kv->epoch, 1, __ATOMIC_SEQ_CST);
+    for (r = __atomic_load_n(&kv->arenas, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t e = __atomic_load_n(&r->active, __ATOMIC_SEQ_CST);
+        if (e && e < safe) {
+            safe = e;
+        }
+    }
+
+    freeloc *f = a->limbo, *next;
+    while (f) {
+        next = f->next;
+        if (f->epoch < safe) {
+            loc l = f->l;
+            a->limbo = freelist_remove(a->limbo, f);
+            a->nlimbo--;
+            arena_cache_push(kv, a, l);
+        }
+        f = next;
+    }
+}
+
+// Give up the rest of the chunk. Unused space is laid out as free slots so
+// that scans can walk over it. Arena lock held.
+static void arena_retire(lightkv *kv, arena *a) {
+    if (a->cap == 0) {
+        return;
+    }
+
+    while (a->cap - a->used >= RECORD_HEADER_SIZE) {
+        uint32_t piece = free_piece(a->cap - a->used);
+
+        loc l = a->base;
+        l.l.offset += a->used;
+        l.l.sclass = get_sizeslot(piece);
+
+        record rh;
+        memset(&rh, 0, sizeof(rh));
+        rh.type = RECORD_DEL;
+        rh.len = piece;
+        rh.crc = record_crc(&rh);
+        arena_write(kv, a, l, (char *) &rh, RECORD_HEADER_SIZE);
+        arena_cache_push(kv, a, l);
+        a->used += piece;
+    }
+
+    arena_flush(kv, a);
+    __atomic_store_n(&a->cap, 0, __ATOMIC_RELEASE);
+    a->used = 0;
+}
+
+// Replace the chunk of arena with a fresh one from the tail
+static void arena_newchunk(lightkv *kv, arena *a) {
+    pthread_mutex_lock(&a->lock);
+    arena_retire(kv, a);
+    pthread_mutex_unlock(&a->lock);
+
+    loc base = take_tailloc(kv, kv->chunksize);
+
+    pthread_mutex_lock(&a->lock);
+#ifndef USE_MMAP
+    if (kv->buffered) {
+        if (a->buf == NULL) {
+            a->buf = (char *) malloc(kv->chunksize);
+        }
+        memset(a->buf, 0, kv->chunksize);
+    }
+#endif
+    base.l.sclass = 0;
+    a->used = 0;
+    __atomic_store_n(&a->base.val, base.val, __ATOMIC_RELAXED);
+    __atomic_store_n(&a->cap, kv->chunksize, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&a->lock);
+}
+
+// Detach arena from its thread, called at thread exit
+static void arena_release(void *arg) {
+    arena *a = (arena *) arg;
+    lightkv *kv = a->kv;
+    int i;
+
+    pthread_mutex_lock(&a->lock);
+    arena_retire(kv, a);
+    // Slots still quarantined stay with the arena for its next owner
+    arena_reclaim(kv, a);
+    for (i=0; i < MAX_SIZES; i++) {
+        while (a->cache[i]) {
+            freelist_push(kv, a->cache[i]->l);
+            a->cache[i] = freelist_remove(a->cache[i], a->cache[i]);
+        }
+        a->ncache[i] = 0;
+    }
+    pthread_mutex_unlock(&a->lock);
+
+    pthread_mutex_lock(&kv->arenalock);
+    a->inuse = false;
+    pthread_mutex_unlock(&kv->arenalock);
+}
+
+// Find the arena whose buffered chunk holds [l, l+len) and return it locked.
+// Chunks which only partially overlap are flushed.
+static arena *arena_find(lightkv *kv, loc l, size_t len) {
+    arena *a;
+
+    for (a = __atomic_load_n(&kv->arenas, __ATOMIC_ACQUIRE); a; a = a->next) {
+        if (!arena_overlaps(a, l.l.num, l.l.offset, len)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&a->lock);
+        if (a->buf && arena_covers(a, l.l.num, l.l.offset, len)) {
+            return a;
+        }
+        arena_flush(kv, a);
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    return NULL;
+}
+
+#ifndef USE_MMAP
+// Reads overlapping buffered data flush the chunk first
+static void arena_read_barrier(lightkv *kv, loc l, size_t len) {
+    arena *a;
+
+    if (!kv->buffered) {
+        return;
+    }
+
+    for (a = __atomic_load_n(&kv->arenas, __ATOMIC_ACQUIRE); a; a = a->next) {
+        if (arena_overlaps(a, l.l.num, l.l.offset, len)) {
+            pthread_mutex_lock(&a->lock);
+            if (arena_overlaps(a, l.l.num, l.l.offset, len)) {
+                uint32_t off = l.l.offset > a->base.l.offset ? l.l.offset - a->base.l.offset : 0;
+                if (off < a->dirty_hi && off + len > a->dirty_lo) {
+                    arena_flush(kv, a);
+                }
+            }
+            pthread_mutex_unlock(&a->lock);
+        }
+    }
+}
+#endif
+
+static int write_buf(lightkv *kv, loc l, const char *buf, size_t len) {
+    if (kv->buffered) {
+        arena *a = arena_find(kv, l, len);
+        if (a) {
+            int n = arena_write(kv, a, l, buf, len);
+            pthread_mutex_unlock(&a->lock);
+            return n;
+        }
+    }
+
+    return write_direct(kv, l, buf, len);
+}
+
+int write_record(lightkv *kv, loc l, record *rec) {
+    return write_buf(kv, l, (char *) rec, rec->len);
+}
+
+int read_record(lightkv *kv, loc l, record **rec) {
+    size_t slotsize = get_slotsize(l.l.sclass);
+    *rec = (record *) malloc(slotsize);
+#ifdef USE_MMAP
+    char *src;
+    src = (char *) kv->filemaps[l.l.num] + l.l.offset;
+    memcpy(*rec, src, slotsize);
+    mem_touch(kv, l.l.num, l.l.offset);
+#else
+    arena_read_barrier(kv, l, slotsize);
+    ssize_t n = pread(kv->fds[l.l.num], (char *) *rec, slotsize, l.l.offset);
+    // Past the end of file reads as unallocated space
+    if (n < (ssize_t) slotsize) {
+        memset((char *) *rec + (n > 0 ? n : 0), 0, slotsize - (n > 0 ? n : 0));
+    }
+#endif
+
+    return 0;
+}
+
+record read_recheader(lightkv *kv, loc l) {
+    record rh;
+    memset(&rh, 0, sizeof(rh));
+#ifdef USE_MMAP
+    char *src = (char *) kv->filemaps[l.l.num] + l.l.offset;
+    memcpy((char *) &rh, src, sizeof(rh));
+#else
+    arena_read_barrier(kv, l, sizeof(rh));
+    pread(kv->fds[l.l.num], (char *) &rh, sizeof(rh), l.l.offset);
+#endif
+
+    return rh;
+}
+
+int lightkv_init(lightkv **kv, const char *base, bool prealloc) {
+    // TODO: Add sanity checks
+
+    *kv = (lightkv *) malloc(sizeof(lightkv));
+
+    (*kv)->version = LIGHTKV_FORMAT_VERSION;
+    (*kv)->error = 0;
+    (*kv)->verify = LIGHTKV_VERIFY_NEVER;
+    (*kv)->verify_every = 1;
+    (*kv)->prealloc = prealloc;
+    (*kv)->basepath = strdup(base);
+#ifdef USE_MMAP
+    (*kv)->filemaps[0] = NULL;
+#else
+    (*kv)->fds[0] = -1;
+#endif
+    (*kv)->nfiles = 1;
+    pthread_mutex_init(&(*kv)->filelock, NULL);
+
+    (*kv)->arenas = NULL;
+    (*kv)->chunksize = ARENA_CHUNK;
+    (*kv)->buffered = false;
+    (*kv)->epoch = 1;
+    memset((*kv)->splits, 0, sizeof((*kv)->splits));
+    memset((*kv)->dirty, 0, sizeof((*kv)->dirty));
+    (*kv)->flusher_on = false;
+    (*kv)->flusher_stop = false;
+    (*kv)->syncreq = 0;
+    (*kv)->syncdone = 0;
+    pthread_mutex_init(&(*kv)->synclock, NULL);
+    pthread_cond_init(&(*kv)->syncwork, NULL);
+    pthread_cond_init(&(*kv)->syncdone_cond, NULL);
+    (*kv)->walfd = -1;
+    (*kv)->wallsn = 0;
+    (*kv)->walgen = 0;
+    (*kv)->walreplayed = 0;
+    (*kv)->walfailed = false;
+    (*kv)->walbuf = NULL;
+    (*kv)->durability = LIGHTKV_DURABLE_NONE;
+    (*kv)->seqno = 0;
+    (*kv)->changes = NULL;
+    (*kv)->changemask = 0;
+    (*kv)->changestart = 1;
+    (*kv)->cache = NULL;
+    (*kv)->compress_min = 0;
+    memset((*kv)->dicts, 0, sizeof((*kv)->dicts));
+    (*kv)->dictid = 0;
+    pthread_mutex_init(&(*kv)->dictlock, NULL);
+    (*kv)->heat = NULL;
+    (*kv)->tierq = NULL;
+    (*kv)->tierhead = 0;
+    (*kv)->tiertail = 0;
+    memset((*kv)->hotmap, 0, sizeof((*kv)->hotmap));
+    (*kv)->tiercap = 0;
+    (*kv)->tierused = 0;
+    (*kv)->tiermoved = 0;
+    (*kv)->forwarded = NULL;
+    (*kv)->moved = NULL;
+    (*kv)->movedctx = NULL;
+    (*kv)->tierinterval = TIER_INTERVAL;
+    (*kv)->migrator_on = false;
+    (*kv)->migrator_stop = false;
+    pthread_mutex_init(&(*kv)->tierlock, NULL);
+    pthread_rwlock_init(&(*kv)->movelock, NULL);
+    pthread_cond_init(&(*kv)->tierwake, NULL);
+    memset((*kv)->wheel, 0, sizeof((*kv)->wheel));
+    (*kv)->due = NULL;
+    (*kv)->wheelnow = (uint32_t) time(NULL);
+    (*kv)->nexpiring = 0;
+    (*kv)->nexpired = 0;
+    pthread_mutex_init(&(*kv)->wheellock, NULL);
+    (*kv)->memresident = 0;
+    (*kv)->memreclaimed = 0;
+#ifdef USE_MMAP
+    memset((*kv)->touched, 0, sizeof((*kv)->touched));
+    memset((*kv)->resident, 0, sizeof((*kv)->resident));
+    (*kv)->membudget = 0;
+    (*kv)->govtick = 0;
+    (*kv)->governor_on = false;
+    (*kv)->governor_stop = false;
+    pthread_mutex_init(&(*kv)->govlock, NULL);
+    pthread_cond_init(&(*kv)->govwake, NULL);
+#endif
+    pthread_mutex_init(&(*kv)->wallock, NULL);
+    pthread_mutex_init(&(*kv)->walsynclock, NULL);
+    pthread_mutex_init(&(*kv)->ckptlock, NULL);
+    pthread_rwlock_init(&(*kv)->batchlock, NULL);
+    pthread_mutex_init(&(*kv)->arenalock, NULL);
+    pthread_key_create(&(*kv)->arenakey, arena_release);
+
+    int i;
+    for (i=0; i <MAX_SIZES; i++) {
+        (*kv)->freelist[i] = NULL;
+        pthread_mutex_init(&(*kv)->freelocks[i], NULL);
+    }
+
+    char *f = getfilepath(base, 0);
+    if (access(f, F_OK ) != -1) {
+        int num = 0;
+        char *fn;
+        (*kv)->has_scanned = false;
+
+        while (1) {
+            fn = getfilepath(base, num);
+            if (access(fn, F_OK|R_OK|W_OK) != -1) {
+#ifdef USE_MMAP
+                if (map_file(&(*kv)->filemaps[num], fn) < 0) {
+                    assert(false);
+                }
+#else
+                if (init_file(&(*kv)->fds[num], fn) < 0) {
+                    assert(false);
+                }
+#endif
+                num++;
+                (*kv)->nfiles = num;
+                free(fn);
+            } else {
+                free(fn);
+                break;
+            }
+        }
+    } else {
+        (*kv)->has_scanned = true;
+
+#ifdef USE_MMAP
+        alloc_file(f, MAX_FILESIZE);
+        if (map_file(&(*kv)->filemaps[0], f) < 0) {
+            assert(false);
+        }
+#else
+        if (init_file(&(*kv)->fds[0], f) < 0) {
+            assert(false);
+        }
+#endif
+    }
+
+    free(f);
+
+    loc x;
+    x.val = 0;
+    x.l.num = 0;
+    x.l.offset = 0;
+
+    (*kv)->end_loc = x;
+    x.l.offset = 1;
+    (*kv)->start_loc = x;
+
+    if ((*kv)->has_scanned) {
+        stamp_datafile(*kv, 0);
+    } else {
+        uint8_t version = 0;
+        read_direct(*kv, 0, 0, (char *) &version, 1);
+        if (version != (*kv)->version) {
+            debug_log("Operation:Open, data files are of version %d", version);
+            (*kv)->error = LIGHTKV_ERR_VERSION;
+            return -1;
+        }
+    }
+
+    load_dicts(*kv);
+
+    // Redo logged writes, then pick up from the last close or checkpoint.
+    // Without a usable superblock nothing says where the data ends.
+    if (wal_recover(*kv) < 0) {
+        return -1;
+    }
+    if (!(*kv)->has_scanned && load_super(*kv) < 0) {
+        lightkv_recover(*kv, RECOVER_THREADS);
+    }
+
+    return 0;
+}
+
+// Lay out a VAL record into a zeroed buffer of atleast header + keylen + len
+// bytes, and 4 more with an expiry
+static void fill_record(record *rec, const char *key, int keylen, const char *val, size_t len, uint32_t expiry, uint64_t seqno) {
+    uint32_t off = RECORD_HEADER_SIZE + keylen;
+
+    rec->type = RECORD_VAL;
+    rec->extlen = keylen;
+    rec->flags = 0;
+    rec->seqno = (uint32_t) seqno;
+    memcpy((char *) rec + RECORD_HEADER_SIZE, key, keylen);
+    if (expiry) {
+        rec->flags = RECORD_EXPIRES;
+        memcpy((char *) rec + off, &expiry, sizeof(expiry));
+        off += sizeof(expiry);
+    }
+    rec->len = off + len;
+    memcpy((char *) rec + off, val, len);
+    rec->crc = record_crc(rec);
+}
+
+static uint32_t record_crc(const record *rec) {
+    uint32_t len = rec->type == RECORD_VAL ? rec->len : RECORD_HEADER_SIZE;
+    uint32_t crc = crc32c(0, rec, offsetof(record, crc));
+    return crc32c(crc, (const char *) rec + offsetof(record, seqno), len - offsetof(record, seqno));
+}
+
+static bool verify_record(const record *rec) {
+    if (rec->len < RECORD_HEADER_SIZE || rec->len > MAX_RECORD_SIZE) {
+        return false;
+    }
+    return record_crc(rec) == rec->crc;
+}
+
+static bool should_verify(lightkv *kv, int kind) {
+    if (kv->verify & kind) {
+        return true;
+    }
+    if (kv->verify & LIGHTKV_VERIFY_SAMPLED) {
+        arena *a = arena_get(kv);
+        if (++a->nverify >= kv->verify_every) {
+            a->nverify = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+void lightkv_set_verify(lightkv *kv, int mode, uint32_t every) {
+    kv->verify = mode;
+    kv->verify_every = every ? every : 1;
+}
+
+uint32_t lightkv_crc32c(uint32_t crc, const void *buf, size_t len) {
+    return crc32c(crc, buf, len);
+}
+
+bool lightkv_has_error(lightkv *kv) {
+    return kv->error != 0;
+}
+
+char *lightkv_errorstr(lightkv *kv) {
+    switch (kv->error) {
+        case 0:
+            return (char *) "no error";
+        case LIGHTKV_ERR_CHECKSUM:
+            return (char *) "record checksum mismatch";
+        case LIGHTKV_ERR_VERSION:
+            return (char *) "data files are of another format version";
+        case LIGHTKV_ERR_WAL:
+            return (char *) "write ahead log could not be written";
+        case LIGHTKV_ERR_WRITE:
+            return (char *) "data file could not be written";
+    }
+    return (char *) "unknown error";
+}
+
+// Recovery state of a single data file
+typedef struct {
+    uint16_t    num;
+    uint32_t    start; // Offset the scan begins at
+    freeloc     *freelist[MAX_SIZES]; // Free slots found in the file
+    uint32_t    tail; // Last byte in use, 0 for an empty file
+    bool        sealed; // File ends with an end marker
+} filescan;
+
+// Shared state of recovery workers
+typedef struct {
+    lightkv     *kv;
+    filescan    *files;
+    uint16_t    nfiles; // Files to scan, files[0] being the first
+    uint16_t    next; // Next file to be picked up
+} recovery;
+
+// Copy upto len bytes at offset of file num, returns bytes available
+static size_t read_direct(lightkv *kv, uint16_t num, uint64_t offset, char *buf, size_t len) {
+    if (offset >= MAX_FILESIZE) {
+        return 0;
+    }
+    if (offset + len > MAX_FILESIZE) {
+        len = MAX_FILESIZE - offset;
+    }
+#ifdef USE_MMAP
+    memcpy(buf, (char *) kv->filemaps[num] + offset, len);
+    return len;
+#else
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(kv->fds[num], buf + done, len - done, offset + done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+#endif
+}
+
+// Lay out [offset, offset+len) of a file as free slots, so scans walk over it
+static void fill_gap(lightkv *kv, filescan *fs, uint64_t offset, uint64_t len) {
+    debug_log("Operation:Recover, filling gap of %"PRIu64" bytes at %d:%"PRIu64, len, fs->num, offset);
+    while (len >= RECORD_HEADER_SIZE) {
+        uint32_t piece = free_piece(len);
+        loc l;
+        l.l.num = fs->num;
+        l.l.offset = offset;
+        l.l.sclass = get_sizeslot(piece);
+
+        record rh;
+        memset(&rh, 0, sizeof(rh));
+        rh.type = RECORD_DEL;
+        rh.len = piece;
+        rh.crc = record_crc(&rh);
+        write_direct(kv, l, (char *) &rh, RECORD_HEADER_SIZE);
+        fs->freelist[l.l.sclass] = freelist_add(fs->freelist[l.l.sclass], freeloc_new(l));
+        mark_recstart(kv, fs->num, offset);
+
+        offset += piece;
+        len -= piece;
+    }
+}
+
+// Can this header start a record? VAL records are checked whole later.
+static bool valid_header(const record *rh) {
+    if (rh->len < RECORD_HEADER_SIZE || rh->len > MAX_RECORD_SIZE || (rh->flags & ~RECORD_FLAGS)) {
+        return false;
+    }
+    switch (rh->type) {
+        case RECORD_VAL:
+            return val_offset(rh) <= rh->len;
+        case RECORD_DEL:
+            return !(rh->len & (rh->len - 1)) && record_crc(rh) == rh->crc;
+        case RECODE_END:
+            return record_crc(rh) == rh->crc;
+    }
+    return false;
+}
+
+// Zero [offset, offset+len) of a file
+static void zero_range(lightkv *kv, uint16_t num, uint64_t offset, uint64_t len) {
+    char *zeros = (char *) calloc(DIRTY_GRAIN, 1);
+    loc l;
+    l.val = 0;
+    l.l.num = num;
+
+    while (len) {
+        uint32_t n = len < DIRTY_GRAIN ? len : DIRTY_GRAIN;
+        l.l.offset = offset;
+        write_direct(kv, l, zeros, n);
+        offset += n;
+        len -= n;
+    }
+    free(zeros);
+}
+
+// Walk the records of a data file with large sequential reads, checking
+// every header and VAL checksum.
+// - Runs of zeros left by unused arena chunks are turned into free slots
+//   when more records follow them.
+// - A damaged record, or a torn write, ends the run of consistent records.
+//   Records start on RECORD_HEADER_SIZE boundaries, so the scan steps over
+//   it looking for the next valid record. With nothing valid after it, it is
+//   a torn tail: the space is zeroed and the file ends at the last
+//   consistent record. Damage with valid records after it is left alone and
+//   reported as a checksum error.
+static void scan_datafile(lightkv *kv, filescan *fs) {
+    char *buf = (char *) malloc(RECOVER_READSIZE), *big = NULL;
+    uint64_t bufoff = 0, buflen = 0;
+    uint64_t off = fs->start, gap = 0, torn = 0, tornend = 0, damaged = 0;
+
+    while (off + RECORD_HEADER_SIZE <= MAX_FILESIZE) {
+        if (off < bufoff || off + RECORD_HEADER_SIZE > bufoff + buflen) {
+            bufoff = off;
+            buflen = read_direct(kv, fs->num, off, buf, RECOVER_READSIZE);
+            if (buflen < RECORD_HEADER_SIZE) {
+                // A partial header at the end of file is torn as well
+                if (buflen && torn == 0) {
+                    torn = off;
+                }
+                if (torn) {
+                    tornend = off + buflen;
+                }
+                break;
+            }
+        }
+
+        record rh;
+        uint64_t w[2];
+        memcpy(&rh, buf + (off - bufoff), RECORD_HEADER_SIZE);
+        memcpy(w, &rh, RECORD_HEADER_SIZE);
+        if (w[0] == 0 && w[1] == 0) {
+            // Skip over zeros a header at a time
+            if (gap == 0 && torn == 0) {
+                gap = off;
+            }
+            do {
+                off += RECORD_HEADER_SIZE;
+                if (off + RECORD_HEADER_SIZE > bufoff + buflen) {
+                    break;
+                }
+                memcpy(w, buf + (off - bufoff), RECORD_HEADER_SIZE);
+            } while (w[0] == 0 && w[1] == 0);
+            continue;
+        }
+
+        bool ok = valid_header(&rh);
+        if (ok && rh.type == RECORD_VAL) {
+            const record *rec;
+            if (off + rh.len > bufoff + buflen) {
+                bufoff = off;
+                buflen = read_direct(kv, fs->num, off, buf, RECOVER_READSIZE);
+            }
+            if (off + rh.len <= bufoff + buflen) {
+                rec = (const record *) (buf + (off - bufoff));
+            } else {
+                // Larger than the read buffer
+                big = (char *) realloc(big, rh.len);
+                ok = read_direct(kv, fs->num, off, big, rh.len) == rh.len;
+                rec = (const record *) big;
+            }
+            ok = ok && verify_record(rec);
+            if (ok && (rh.flags & RECORD_EXPIRES)) {
+                loc l;
+                l.l.num = fs->num;
+                l.l.offset = off;
+                l.l.sclass = get_sizeslot(roundsize(rh.len));
+                expire_add(kv, l, record_expiry(rec));
+            }
+        }
+
+        if (!ok) {
+            if (torn == 0) {
+                torn = gap ? gap : off;
+                damaged = off;
+                gap = 0;
+            }
+            off += RECORD_HEADER_SIZE;
+            tornend = off;
+            continue;
+        }
+
+        if (torn) {
+            // Not the tail, the damage is left as it is for a repair to look at
+            debug_log("Operation:Recover, %"PRIu64" damaged bytes at %d:%"PRIu64, off - damaged, fs->num, damaged);
+            kv->error = LIGHTKV_ERR_CHECKSUM;
+            if (damaged > torn) {
+                fill_gap(kv, fs, torn, damaged - torn);
+            }
+            torn = 0;
+        } else if (gap) {
+            fill_gap(kv, fs, gap, off - gap);
+            gap = 0;
+        }
+
+        if (rh.type == RECODE_END) {
+            fs->sealed = true;
+            break;
+        }
+
+        if (rh.seqno) {
+            note_seqno(kv, rh.seqno);
+        }
+
+        uint32_t rsize = roundsize(rh.len);
+        mark_recstart(kv, fs->num, off);
+        if (rh.type == RECORD_DEL) {
+            loc l;
+            l.l.num = fs->num;
+            l.l.offset = off;
+            l.l.sclass = get_sizeslot(rsize);
+            fs->freelist[l.l.sclass] = freelist_add(fs->freelist[l.l.sclass], freeloc_new(l));
+        }
+
+        fs->tail = off + rsize - 1;
+        off += rsize;
+    }
+
+    if (torn) {
+        // Torn tail, later appends must not run into its leftovers
+        debug_log("Operation:Recover, zeroing torn tail of %"PRIu64" bytes at %d:%"PRIu64, tornend - torn, fs->num, torn);
+        zero_range(kv, fs->num, torn, tornend - torn);
+    }
+
+    free(big);
+    free(buf);
+}
+
+static void *recover_worker(void *arg) {
+    recovery *r = (recovery *) arg;
+    uint16_t num;
+
+    while ((num = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED)) < r->nfiles) {
+        scan_datafile(r->kv, &r->files[num]);
+    }
+
+    return NULL;
+}
+
+int lightkv_recover(lightkv *kv, int nthreads) {
+    int slot;
+    loc from;
+
+    // Everything is found again
+    for (slot=0; slot < MAX_SIZES; slot++) {
+        while (kv->freelist[slot]) {
+            kv->freelist[slot] = freelist_remove(kv->freelist[slot], kv->freelist[slot]);
+        }
+    }
+
+    from.val = 0;
+    return recover_from(kv, from, nthreads);
+}
+
+static int recover_from(lightkv *kv, loc from, int nthreads) {
+    recovery r;
+    int i, slot;
+
+    r.kv = kv;
+    r.nfiles = kv->nfiles - from.l.num;
+    r.next = 0;
+    r.files = (filescan *) calloc(r.nfiles, sizeof(filescan));
+    for (i=0; i < r.nfiles; i++) {
+        r.files[i].num = from.l.num + i;
+        r.files[i].start = 1;
+    }
+    r.files[0].start = from.l.offset + 1;
+    r.files[0].tail = from.l.offset;
+
+    debug_log("Operation:Recover, %d files from "LOCSTR" with %d threads", r.nfiles, LOCPARAMS(from), nthreads);
+    if (nthreads > r.nfiles) {
+        nthreads = r.nfiles;
+    }
+
+    if (nthreads <= 1) {
+        recover_worker(&r);
+    } else {
+        pthread_t *workers = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+        for (i=0; i < nthreads; i++) {
+            pthread_create(&workers[i], NULL, recover_worker, &r);
+        }
+        for (i=0; i < nthreads; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        free(workers);
+    }
+
+    // Merge per file results
+    for (i=0; i < r.nfiles; i++) {
+        filescan *fs = &r.files[i];
+        for (slot=0; slot < MAX_SIZES; slot++) {
+            freeloc *last = fs->freelist[slot];
+            if (last == NULL) {
+                continue;
+            }
+            while (last->next) {
+                last = last->next;
+            }
+            last->next = kv->freelist[slot];
+            if (last->next) {
+                last->next->prev = last;
+            }
+            kv->freelist[slot] = fs->freelist[slot];
+        }
+    }
+
+    loc end;
+    end.val = 0;
+    end.l.num = r.files[r.nfiles - 1].num;
+    end.l.offset = r.files[r.nfiles - 1].tail;
+    __atomic_store_n(&kv->end_loc.val, end.val, __ATOMIC_RELEASE);
+
+    // Files left behind by an interrupted rollover
+    for (i=0; i < r.nfiles - 1; i++) {
+        if (!r.files[i].sealed) {
+            loc l;
+            l.val = 0;
+            l.l.num = r.files[i].num;
+            l.l.offset = r.files[i].tail;
+            seal_datafile(kv, l);
+        }
+    }
+
+    kv->has_scanned = true;
+    free(r.files);
+
+    debug_log("Operation:Recover, end at "LOCSTR, LOCPARAMS(end));
+    return 0;
+}
+
+// Create a VAL or DEL record. Pass recsize = 0 for VAL record.
+record *create_record(uint8_t type, const char *key, const char *val, size_t len, size_t recsize, uint64_t seqno) {
+    record *rec = NULL;
+
+    if (type == RECORD_VAL) {
+        int keylen = strlen(key);
+        recsize = RECORD_HEADER_SIZE + keylen + len;
+        rec = (record *) calloc(recsize, 1);
+        fill_record(rec, key, keylen, val, len, 0, seqno);
+    } else if (type == RECORD_DEL) {
+        rec = (record *) calloc(recsize, 1);
+        rec->type = type;
+        rec->len = recsize;
+        rec->seqno = (uint32_t) seqno;
+        rec->crc = record_crc(rec);
+    }
+
+    return rec;
+}
+
+static record *compress_record(lightkv *kv, const char *key, int keylen, const char *val, size_t len, uint32_t expiry, uint64_t seqno) {
+    uint32_t keyend = RECORD_HEADER_SIZE + keylen + (expiry ? sizeof(expiry) : 0);
+    uint32_t fixed = keyend + sizeof(uint32_t);
+    uint32_t raw = len;
+
+    // Small values go against the active dictionary if there is one
+    uint8_t id = __atomic_load_n(&kv->dictid, __ATOMIC_ACQUIRE);
+    lzdict *dict = id && len <= DICT_MAXVALUE ? kv->dicts[id] : NULL;
+    if (dict == NULL && (kv->compress_min == 0 || len < kv->compress_min)) {
+        return NULL;
+    }
+
+    // Only worth it if the record fits half of its slot
+    uint32_t target = roundsize(keyend + len) / 2;
+    if (target <= fixed) {
+        return NULL;
+    }
+
+    record *rec = (record *) calloc(target, 1);
+    uint32_t clen = dict ?
+        lz_compress_dict(val, len, dict->data, dict->len, dict->table, (char *) rec + fixed, target - fixed) :
+        lz_compress(val, len, (char *) rec + fixed, target - fixed);
+    if (clen == 0) {
+        free(rec);
+        return NULL;
+    }
+
+    rec->type = RECORD_VAL;
+    rec->len = fixed + clen;
+    rec->extlen = keylen;
+    rec->flags = RECORD_COMPRESSED | (expiry ? RECORD_EXPIRES : 0) | (dict ? id << RECORD_DICTSHIFT : 0);
+    rec->seqno = (uint32_t) seqno;
+    memcpy((char *) rec + RECORD_HEADER_SIZE, key, keylen);
+    if (expiry) {
+        memcpy((char *) rec + RECORD_HEADER_SIZE + keylen, &expiry, sizeof(expiry));
+    }
+    memcpy((char *) rec + keyend, &raw, sizeof(raw));
+    rec->crc = record_crc(rec);
+    return rec;
+}
+
+static record *create_value(lightkv *kv, const char *key, const char *val, size_t len, uint32_t expiry, uint64_t seqno) {
+    int keylen = strlen(key);
+    record *rec = compress_record(kv, key, keylen, val, len, expiry, seqno);
+    if (rec == NULL) {
+        rec = (record *) calloc(RECORD_HEADER_SIZE + keylen + sizeof(expiry) + len, 1);
+        fill_record(rec, key, keylen, val, len, expiry, seqno);
+    }
+    return rec;
+}
+
+void lightkv_set_compression(lightkv *kv, uint32_t min) {
+    kv->compress_min = min;
+}
+
+// Dictionaries
+//
+// Small values share structure that per record compression cannot see.
+// A dictionary trained on a sample of them is coded as if it preceded
+// every value. Each lives in its own file under its id, which records
+// compressed with it carry in their flags. Dictionaries are loaded at open
+// and never change while open, so readers look them up without locks.
+
+static bool unpack_value(lightkv *kv, const record *rec, char *dst, uint32_t raw) {
+    int l = rec->len - val_offset(rec) - sizeof(uint32_t);
+    const char *src = (char *) rec + val_offset(rec) + sizeof(uint32_t);
+    int id = RECORD_DICTID(rec->flags);
+
+    if (id == 0) {
+        return lz_decompress(src, l, dst, raw);
+    }
+    lzdict *dict = __atomic_load_n(&kv->dicts[id], __ATOMIC_ACQUIRE);
+    return dict && raw <= DICT_MAXVALUE && lz_decompress_dict(src, l, dict->data, dict->len, dst, raw);
+}
+
+static size_t record_value(lightkv *kv, record *rec, char **v) {
+    if (!(rec->flags & RECORD_COMPRESSED)) {
+        return get_val(rec, v);
+    }
+
+    int l = rec->len - val_offset(rec);
+    uint32_t raw;
+
+    *v = NULL;
+    if (l < (int) sizeof(raw)) {
+        return 0;
+    }
+    memcpy(&raw, (char *) rec + val_offset(rec), sizeof(raw));
+    *v = raw <= MAX_RECORD_SIZE ? (char *) malloc(raw + 1) : NULL;
+    if (*v && !unpack_value(kv, rec, *v, raw)) {
+        free(*v);
+        *v = NULL;
+    }
+    return *v ? raw : 0;
+}
+
+static int write_dict(lightkv *kv, int id, const char *data, uint32_t len) {
+    dictheader dh;
+    char name[200];
+    int rv = -1;
+
+    dh.magic = DICT_MAGIC;
+    dh.id = id;
+    dh.len = len;
+    dh.check = crc32c(crc32c(0, &dh, offsetof(dictheader, check)), data, len);
+
+    snprintf(name, sizeof(name), DICTFILE_FORMATSTR, id);
+    char *tmp = joinpath(kv->basepath, DICTFILE_TMP);
+    char *path = joinpath(kv->basepath, name);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        if (write_all(fd, &dh, sizeof(dh)) &&
+                write_all(fd, data, len) &&
+                fdatasync(fd) == 0) {
+            rv = rename(tmp, path);
+        }
+        close(fd);
+
+        // Make the rename durable
+        int dfd = open(kv->basepath, O_RDONLY);
+        if (dfd >= 0) {
+            fsync(dfd);
+            close(dfd);
+        }
+    }
+    free(tmp);
+    free(path);
+    return rv;
+}
+
+static int load_dicts(lightkv *kv) {
+    DIR *dir = opendir(kv->basepath);
+    struct dirent *d;
+    int id, n = 0;
+
+    if (dir == NULL) {
+        return 0;
+    }
+    while ((d = readdir(dir))) {
+        if (sscanf(d->d_name, DICTFILE_FORMATSTR, &id) != 1 || id <= 0 || id >= MAX_DICTS || kv->dicts[id]) {
+            continue;
+        }
+
+        dictheader dh;
+        char *path = joinpath(kv->basepath, d->d_name);
+        int fd = open(path, O_RDONLY);
+        free(path);
+        if (fd < 0) {
+            continue;
+        }
+        char *data = NULL;
+        bool ok = pread(fd, &dh, sizeof(dh), 0) == sizeof(dh) &&
+            dh.magic == DICT_MAGIC && (int) dh.id == id && dh.len <= LZ_MAXDICT;
+        if (ok) {
+            data = (char *) malloc(dh.len + 1);
+            ok = pread(fd, data, dh.len, sizeof(dh)) == (ssize_t) dh.len &&
+                crc32c(crc32c(0, &dh, offsetof(dictheader, check)), data, dh.len) == dh.check;
+        }
+        close(fd);
+        if (!ok) {
+            debug_log("Operation:Open, bad dictionary %s", d->d_name);
+            free(data);
+            continue;
+        }
+
+        lzdict *dict = (lzdict *) malloc(sizeof(lzdict));
+        dict->len = dh.len;
+        dict->data = data;
+        dict->table = (uint32_t *) malloc(sizeof(uint32_t) << LZ_DICTBITS);
+        lz_dict_table(data, dh.len, dict->table);
+        kv->dicts[id] = dict;
+        if (id > kv->dictid) {
+            kv->dictid = id;
+        }
+        n++;
+    }
+    closedir(dir);
+
+    debug_log("Operation:Open, %d dictionaries, active %d", n, kv->dictid);
+    return n;
+}
+
+int lightkv_train_dict(lightkv *kv, uint32_t nsamples, uint32_t size) {
+    uint32_t *lens = (uint32_t *) malloc((nsamples + 1) * sizeof(uint32_t));
+    size_t total = 0, cap = 65536;
+    char *samples = (char *) malloc(cap);
+    uint32_t n = 0, l;
+    uint64_t recid;
+    char *k, *v;
+    int id;
+
+    if (size > LZ_MAXDICT) {
+        size = LZ_MAXDICT;
+    }
+
+    lightkv_iter *it = lightkv_iterator(kv);
+    while (n < nsamples && lightkv_next(it, &recid, &k, &v, &l)) {
+        if (l <= DICT_MAXVALUE) {
+            if (total + l > cap) {
+                cap = (total + l) * 2;
+                samples = (char *) realloc(samples, cap);
+            }
+            memcpy(samples + total, v, l);
+            total += l;
+            lens[n++] = l;
+        }
+        free(k);
+        free(v);
+    }
+    lightkv_free_iter(it);
+
+    char *data = (char *) malloc(size + 1);
+    uint32_t len = lz_train(samples, lens, n, data, size);
+    free(samples);
+    free(lens);
+
+    pthread_mutex_lock(&kv->dictlock);
+    for (id=MAX_DICTS - 1; id > 0 && kv->dicts[id] == NULL; id--);
+    id++;
+    if (len < LZ_MINMATCH || id >= MAX_DICTS || write_dict(kv, id, data, len) < 0) {
+        pthread_mutex_unlock(&kv->dictlock);
+        debug_log("Operation:Train, no dictionary from %u samples", n);
+        free(data);
+        return -1;
+    }
+
+    lzdict *dict = (lzdict *) malloc(sizeof(lzdict));
+    dict->len = len;
+    dict->data = data;
+    dict->table = (uint32_t *) malloc(sizeof(uint32_t) << LZ_DICTBITS);
+    lz_dict_table(data, len, dict->table);
+    __atomic_store_n(&kv->dicts[id], dict, __ATOMIC_RELEASE);
+    __atomic_store_n(&kv->dictid, id, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&kv->dictlock);
+
+    debug_log("Operation:Train, dictionary %d of %u bytes from %u samples", id, len, n);
+    return id;
+}
+
+static void freelist_push(lightkv *kv, loc l) {
+    freeloc *f = freeloc_new(l);
+
+    pthread_mutex_lock(&kv->freelocks[l.l.sclass]);
+    __atomic_store_n(&kv->freelist[l.l.sclass], freelist_add(kv->freelist[l.l.sclass], f), __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&kv->freelocks[l.l.sclass]);
+}
+
+static bool take_freeloc(lightkv *kv, size_t size, loc *l) {
+    int slot = get_sizeslot(size);
+
+    // Racy peek, saves the lock when a class has nothing to offer
+    if (__atomic_load_n(&kv->freelist[slot], __ATOMIC_RELAXED) == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&kv->freelocks[slot]);
+    freeloc *f = freelist_get(kv->freelist[slot], size);
+    if (f == NULL) {
+        pthread_mutex_unlock(&kv->freelocks[slot]);
+        return false;
+    }
+
+    *l = f->l;
+    l->l.sclass = slot;
+    __atomic_store_n(&kv->freelist[slot], freelist_remove(kv->freelist[slot], f), __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&kv->freelocks[slot]);
+    return true;
+}
+
+static loc take_tailloc(lightkv *kv, size_t size) {
+    loc l = create_nextloc(kv, size);
+    l.l.sclass = get_sizeslot(size);
+    return l;
+}
+
+loc find_freeloc(lightkv *kv, size_t size) {
+    loc l;
+
+    if (!take_freeloc(kv, size, &l)) {
+        l = take_tailloc(kv, size);
+    }
+
+    return l;
+}
+
+static bool place_record(lightkv *kv, record *rec, loc *l) {
+    uint32_t rsize = roundsize(rec->len);
+    int n;
+
+    // Large records bypass the arena
+    if (rsize > kv->chunksize / ARENA_MAXFRAC) {
+        if (!take_freeloc(kv, rsize, l)) {
+            *l = take_tailloc(kv, rsize);
+        }
+        return write_record(kv, *l, rec) >= 0;
+    }
+
+    arena *a = arena_get(kv);
+    while (1) {
+        pthread_mutex_lock(&a->lock);
+        if (arena_take(a, rsize, l)) {
+            if (arena_covers(a, l->l.num, l->l.offset, rec->len)) {
+                n = arena_write(kv, a, *l, (char *) rec, rec->len);
+                pthread_mutex_unlock(&a->lock);
+            } else {
+                pthread_mutex_unlock(&a->lock);
+                n = write_record(kv, *l, rec);
+            }
+            return n >= 0;
+        }
+
+        if (a->nlimbo) {
+            uint32_t n = a->nlimbo;
+            arena_reclaim(kv, a);
+            if (a->nlimbo < n) {
+                pthread_mutex_unlock(&a->lock);
+                continue;
+            }
+        }
+        pthread_mutex_unlock(&a->lock);
+
+        if (!arena_refill(kv, a, get_sizeslot(rsize))) {
+            arena_newchunk(kv, a);
+        }
+    }
+}
+
+uint64_t lightkv_insert(lightkv *kv, const char *key, const char *val, uint32_t len) {
+    return lightkv_insert_ttl(kv, key, val, len, 0);
+}
+
+uint64_t lightkv_insert_ttl(lightkv *kv, const char *key, const char *val, uint32_t len, uint32_t ttl) {
+    debug_log("Operation:Insert, key:%s vallen:%d ttl:%u", key, len, ttl);
+    loc diskloc;
+    if (__atomic_load_n(&kv->walfailed, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    uint32_t expiry = ttl ? (uint32_t) time(NULL) + ttl : 0;
+    uint64_t seqno = next_seqno(kv, 1);
+    record *rec = create_value(kv, key, val, len, expiry, seqno);
+    bool placed = place_record(kv, rec, &diskloc);
+    uint64_t lsn = placed ? wal_append(kv, diskloc, (char *) rec, rec->len) : WAL_FAILED;
+    free(rec);
+    bool logged = wal_commit(kv, lsn);
+    publish_change(kv, seqno, diskloc, RECORD_VAL);
+    if (!logged) {
+        // Not written or not logged, so not kept either. Its seqno is
+        // published all the same, a hole would hold up the change feed.
+        delete_slot(kv, diskloc);
+        return 0;
+    }
+    if (expiry) {
+        expire_add(kv, diskloc, expiry);
+    }
+    if (__atomic_load_n(&kv->nexpiring, __ATOMIC_RELAXED)) {
+        expire_step(kv, EXPIRE_STEP, false);
+    }
+
+    debug_log("Operation:Insert, completed at target:"LOCSTR, LOCPARAMS(diskloc));
+    return diskloc.val;
+}
+
+// Allocation state of a record within an insert batch
+typedef struct {
+    loc         l;
+    uint32_t    rsize;
+    size_t      pos; // Offset of record in the batch buffer
+    record      *packed; // Compressed record, NULL if stored as is
+    bool        tail;
+} batchslot;
+
+bool lightkv_insert_batch(lightkv *kv, const char **keys, const char **vals, const uint32_t *lens, size_t n, uint64_t *recids) {
+    debug_log("Operation:InsertBatch, count:%zu", n);
+    size_t i, tailbytes = 0, freebytes = 0;
+    batchslot *slots;
+    bool written = true;
+    char *buf;
+
+    if (n == 0) {
+        return true;
+    }
+
+    uint64_t seqno = next_seqno(kv, n);
+    slots = (batchslot *) malloc(n * sizeof(batchslot));
+    for (i=0; i < n; i++) {
+        slots[i].packed = compress_record(kv, keys[i], strlen(keys[i]), vals[i], lens[i], 0, seqno + i);
+        slots[i].rsize = roundsize(slots[i].packed ? slots[i].packed->len : RECORD_HEADER_SIZE + strlen(keys[i]) + lens[i]);
+    }
+
+    // Allocator pass: reuse free slots where possible, rest goes to the tail
+    arena *a = arena_get(kv);
+    pthread_mutex_lock(&a->lock);
+    for (i=0; i < n; i++) {
+        int slot;
+        slot = get_sizeslot(slots[i].rsize);
+        slots[i].tail = a->cache[slot] == NULL || !arena_take(a, slots[i].rsize, &slots[i].l);
+        if (slots[i].tail) {
+            slots[i].pos = tailbytes;
+            tailbytes += slots[i].rsize;
+        } else {
+            slots[i].pos = freebytes;
+            freebytes += slots[i].rsize;
+        }
+    }
+    pthread_mutex_unlock(&a->lock);
+
+    // Layout pass: every record is built in place in a single buffer, tail
+    // records first and in the order they will sit on disk
+    buf = (char *) calloc(tailbytes + freebytes, 1);
+    for (i=0; i < n; i++) {
+        if (!slots[i].tail) {
+            slots[i].pos += tailbytes;
+        }
+        if (slots[i].packed) {
+            memcpy(buf + slots[i].pos, slots[i].packed, slots[i].packed->len);
+            free(slots[i].packed);
+        } else {
+            fill_record((record *) (buf + slots[i].pos), keys[i], strlen(keys[i]), vals[i], lens[i], 0, seqno + i);
+        }
+    }
+
+    if (tailbytes && tailbytes <= kv->chunksize / ARENA_MAXFRAC) {
+        // Carve the whole tail run out of the arena chunk
+        arena *a = arena_get(kv);
+        loc run;
+
+        pthread_mutex_lock(&a->lock);
+        while (a->cap - a->used < tailbytes) {
+            pthread_mutex_unlock(&a->lock);
+            arena_newchunk(kv, a);
+            pthread_mutex_lock(&a->lock);
+        }
+        run = a->base;
+        run.l.offset += a->used;
+        a->used += tailbytes;
+        written = arena_write(kv, a, run, buf, tailbytes) >= 0;
+        pthread_mutex_unlock(&a->lock);
+
+        for (i=0; i < n; i++) {
+            if (slots[i].tail) {
+                slots[i].l = run;
+                slots[i].l.l.offset += slots[i].pos;
+                slots[i].l.l.sclass = get_sizeslot(slots[i].rsize);
+            }
+        }
+    } else if (tailbytes && (uint64_t) tailbytes + 2 <= MAX_FILESIZE) {
+        // Whole tail run is reserved at once and goes out in one write
+        loc run = take_tailloc(kv, tailbytes);
+        for (i=0; i < n; i++) {
+            if (slots[i].tail) {
+                slots[i].l = run;
+                slots[i].l.l.offset += slots[i].pos;
+                slots[i].l.l.sclass = get_sizeslot(slots[i].rsize);
+            }
+        }
+        written = write_direct(kv, run, buf, tailbytes) >= 0;
+    } else if (tailbytes) {
+        // Too big for a file, runs break at file boundaries
+        size_t run = 0, runlen = 0;
+        for (i=0; i < n; i++) {
+            if (!slots[i].tail) {
+                continue;
+            }
+            slots[i].l = take_tailloc(kv, slots[i].rsize);
+            if (runlen && slots[i].l.l.num == slots[run].l.l.num &&
+                    slots[i].l.l.offset == slots[run].l.l.offset + runlen) {
+                runlen += slots[i].rsize;
+                continue;
+            }
+            if (runlen && write_direct(kv, slots[run].l, buf + slots[run].pos, runlen) < 0) {
+                written = false;
+            }
+            run = i;
+            runlen = slots[i].rsize;
+        }
+        if (write_direct(kv, slots[run].l, buf + slots[run].pos, runlen) < 0) {
+            written = false;
+        }
+    }
+
+    uint64_t lsn = 0;
+    for (i=0; i < n; i++) {
+        record *rec = (record *) (buf + slots[i].pos);
+        if (!slots[i].tail && write_record(kv, slots[i].l, rec) < 0) {
+            written = false;
+        }
+        lsn = wal_append(kv, slots[i].l, (char *) rec, rec->len);
+        recids[i] = slots[i].l.val;
+    }
+
+    free(buf);
+    // One log flush covers the batch. A log that failed fails every later
+    // append, the last lsn included.
+    bool logged = written && wal_commit(kv, lsn);
+    for (i=0; i < n; i++) {
+        publish_change(kv, seqno + i, slots[i].l, RECORD_VAL);
+        if (!logged) {
+            delete_slot(kv, slots[i].l);
+            recids[i] = 0;
+        }
+    }
+    free(slots);
+    if (!logged) {
+        return false;
+    }
+
+    debug_log("Operation:InsertBatch, completed %zu records", n);
+    return true;
+}
+
+void lightkv_read_begin(lightkv *kv) {
+    arena *a = arena_get(kv);
+    uint64_t e;
+
+    if (a->readdepth++) {
+        return;
+    }
+
+    // Recheck so that a reclaim pass which missed our store cannot have
+    // moved the epoch past the one we published
+    do {
+        e = __atomic_load_n(&kv->epoch, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&a->active, e, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    } while (e != __atomic_load_n(&kv->epoch, __ATOMIC_SEQ_CST));
+}
+
+void lightkv_read_end(lightkv *kv) {
+    arena *a = arena_get(kv);
+
+    assert(a->readdepth > 0);
+    if (--a->readdepth == 0) {
+        __atomic_store_n(&a->active, 0, __ATOMIC_RELEASE);
+    }
+}
+
+#ifdef USE_MMAP
+bool lightkv_get_view(lightkv *kv, uint64_t recid, const char **key, uint8_t *keylen, const char **val, uint32_t *len) {
+    loc l;
+    l.val = recid;
+    debug_log("Operation:GetView, target:"LOCSTR, LOCPARAMS(l));
+
+    assert(arena_get(kv)->readdepth > 0);
+    if (kv->moved) {
+        tier_sample(kv, recid);
+    }
+    record *rec = (record *) ((char *) kv->filemaps[l.l.num] + l.l.offset);
+    mem_touch(kv, l.l.num, l.l.offset);
+    if (rec->type != RECORD_VAL || (rec->flags & RECORD_COMPRESSED) || record_expired(rec)) {
+        return false;
+    }
+    if (should_verify(kv, LIGHTKV_VERIFY_GET) && !verify_record(rec)) {
+        kv->error = LIGHTKV_ERR_CHECKSUM;
+        return false;
+    }
+
+    *key = (char *) rec + RECORD_HEADER_SIZE;
+    *keylen = rec->extlen;
+    *val = (char *) rec + val_offset(rec);
+    *len = rec->len - val_offset(rec);
+    return true;
+}
+#endif
+
+bool lightkv_get(lightkv *kv, uint64_t recid, char **key, char **val, uint32_t *len) {
+    bool rv;
+    record *rec;
+    loc l;
+    l.val = recid;
+    debug_log("Operation:Get, target:"LOCSTR, LOCPARAMS(l));
+
+    if (kv->moved) {
+        tier_sample(kv, recid);
+    }
+
+    uint64_t ticket = 0;
+    if (kv->cache) {
+        if (cache_get(kv, recid, key, val, len)) {
+            debug_log("Operation:Get, cached %s of vallen:%d", *key, *len);
+            return true;
+        }
+        ticket = cache_ticket(kv, recid);
+    }
+
+    lightkv_read_begin(kv);
+    read_record(kv, l, &rec);
+    lightkv_read_end(kv);
+    rv = rec->type == RECORD_VAL && !record_expired(rec);
+    if (rv && should_verify(kv, LIGHTKV_VERIFY_GET) && !verify_record(rec)) {
+        debug_log("Operation:Get, checksum mismatch at target:"LOCSTR, LOCPARAMS(l));
+        kv->error = LIGHTKV_ERR_CHECKSUM;
+        rv = false;
+    }
+    if (rv == false) {
+        free(rec);
+        return false;
+    }
+    if (kv->cache) {
+        cache_put(kv, recid, rec, ticket);
+    }
+
+    *key = get_key(rec);
+    *len = record_value(kv, rec, val);
+    free(rec);
+    if (*val == NULL) {
+        debug_log("Operation:Get, bad compressed value at target:"LOCSTR, LOCPARAMS(l));
+        kv->error = LIGHTKV_ERR_CHECKSUM;
+        free(*key);
+        return false;
+    }
+
+    debug_log("Operation:Get, fetched %s of vallen:%d", *key, *len);
+    return true;
+}
+
+bool lightkv_delete(lightkv *kv, uint64_t recid) {
+    // TODO: basic sanity
+    loc l;
+    l.val = recid;
+    debug_log("Operation:Delete, target:"LOCSTR, LOCPARAMS(l));
+    if (__atomic_load_n(&kv->walfailed, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    bool held = tier_hold(kv);
+    if (held && read_recheader(kv, l).type != RECORD_VAL) {
+        tier_release(kv, held);
+        return false;
+    }
+    uint64_t lsn = delete_slot(kv, l);
+    tier_release(kv, held);
+    return wal_commit(kv, lsn);
+}
+
+static uint64_t delete_slot(lightkv *kv, loc l) {
+    uint64_t lsn;
+
+    // A slot still holding its record is not handed out again
+    if (tombstone_slot(kv, l, &lsn)) {
+        retire_slot(kv, l);
+    }
+    return lsn;
+}
+
+static bool tombstone_slot(lightkv *kv, loc l, uint64_t *lsn) {
+    size_t slotsize = get_slotsize(l.l.sclass);
+    uint64_t seqno = next_seqno(kv, 1);
+    record *rec = create_record(RECORD_DEL, NULL, NULL, 0, slotsize, seqno);
+    bool written = write_record(kv, l, rec) >= 0;
+    cache_invalidate(kv, l.val);
+    // Logged before the slot can be handed to another writer
+    *lsn = written ? wal_append(kv, l, (char *) rec, RECORD_HEADER_SIZE) : WAL_FAILED;
+    free(rec);
+    publish_change(kv, seqno, l, RECORD_DEL);
+    return written;
+}
+
+static void retire_slot(lightkv *kv, loc l) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    arena *a = arena_get(kv);
+    freeloc *f = freeloc_new(l);
+    f->epoch = __atomic_load_n(&kv->epoch, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&a->lock);
+    a->limbo = freelist_add(a->limbo, f);
+    if (++a->nlimbo >= EPOCH_BATCH) {
+        arena_reclaim(kv, a);
+    }
+    pthread_mutex_unlock(&a->lock);
+}
+
+uint64_t lightkv_update(lightkv *kv, uint64_t recid, const char *key, const char *val, uint32_t len) {
+    return lightkv_update_ttl(kv, recid, key, val, len, 0);
+}
+
+uint64_t lightkv_update_ttl(lightkv *kv, uint64_t recid, const char *key, const char *val, uint32_t len, uint32_t ttl) {
+    loc l;
+    l.val = recid;
+    debug_log("Operation:Update, target:"LOCSTR" key:%s vallen:%d ttl:%u", LOCPARAMS(l), key, len, ttl);
+    if (__atomic_load_n(&kv->walfailed, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    // Moved away by the migrator, it reported the new recid
+    bool held = tier_hold(kv);
+    if (held && read_recheader(kv, l).type != RECORD_VAL) {
+        tier_release(kv, held);
+        return 0;
+    }
+
+    uint32_t expiry = ttl ? (uint32_t) time(NULL) + ttl : 0;
+    uint64_t seqno = next_seqno(kv, 1);
+    record *rec = create_value(kv, key, val, len, expiry, seqno);
+
+    // We need to find a new slot, also when the record shrinks out of its
+    // size class since scans step by the size of the record in a slot. The
+    // log only has the new image, so with it on a committed value is never
+    // overwritten: the old slot goes once the new one is logged.
+    if (__atomic_load_n(&kv->walfd, __ATOMIC_ACQUIRE) >= 0 || get_sizeslot(roundsize(rec->len)) != l.l.sclass) {
+        loc old = l;
+        bool placed = place_record(kv, rec, &l);
+        uint64_t lsn = placed ? wal_append(kv, l, (char *) rec, rec->len) : WAL_FAILED;
+        free(rec);
+        bool logged = wal_commit(kv, lsn);
+        publish_change(kv, seqno, l, RECORD_VAL);
+        if (!logged) {
+            // The old record stays as it was
+            delete_slot(kv, l);
+            tier_release(kv, held);
+            return 0;
+        }
+        wal_commit(kv, delete_slot(kv, old));
+        tier_release(kv, held);
+    } else {
+        int n = write_record(kv, l, rec);
+        cache_invalidate(kv, l.val);
+        tier_release(kv, held);
+        free(rec);
+        publish_change(kv, seqno, l, RECORD_VAL);
+        if (n < 0) {
+            return 0;
+        }
+    }
+    if (expiry) {
+        expire_add(kv, l, expiry);
+    }
+    if (__atomic_load_n(&kv->nexpiring, __ATOMIC_RELAXED)) {
+        expire_step(kv, EXPIRE_STEP, false);
+    }
+
+    debug_log("Operation:Update, completed at target:"LOCSTR, LOCPARAMS(l));
+    return l.val;
+}
+
+// Memory governor
+//
+// Every access through a mapping stamps its region with the current pass.
+// A pass counts resident pages of each region with mincore. Regions left
+// unused for GOVERN_COLD passes are moved to the inactive list once, so
+// the kernel reclaims them first; over budget, whole regions are paged out
+// least recently used first till the total is GOVERN_LOW percent of it.
+
+#ifdef USE_MMAP
+static void mem_touch(lightkv *kv, uint16_t num, uint64_t offset) {
+    uint32_t *t = &kv->touched[num][offset / GOVERN_GRAIN];
+    uint32_t tick = __atomic_load_n(&kv->govtick, __ATOMIC_RELAXED);
+
+    // Stores only once per pass, keeps the line shared
+    if (__atomic_load_n(t, __ATOMIC_RELAXED) != tick) {
+        __atomic_store_n(t, tick, __ATOMIC_RELAXED);
+    }
+}
+
+typedef struct {
+    uint16_t    num, region;
+    uint32_t    touched;
+} memregion;
+
+static int memregion_cmp(const void *x, const void *y) {
+    const memregion *a = (const memregion *) x, *b = (const memregion *) y;
+    if (a->touched != b->touched) {
+        return a->touched < b->touched ? -1 : 1;
+    }
+    return 0;
+}
+
+// Page out a region, dirty pages are written back to the file first
+static void mem_pageout(lightkv *kv, uint16_t num, int region) {
+    char *addr = (char *) kv->filemaps[num] + (uint64_t) region * GOVERN_GRAIN;
+#ifdef MADV_PAGEOUT
+    if (madvise(addr, GOVERN_GRAIN, MADV_PAGEOUT) == 0) {
+        return;
+    }
+#endif
+    // Shared file pages stay in the page cache, only our mapping goes
+    madvise(addr, GOVERN_GRAIN, MADV_DONTNEED);
+}
+
+static void governor_pass(lightkv *kv) {
+    long pagesize = sysconf(_SC_PAGESIZE);
+    unsigned char *vec = (unsigned char *) malloc(GOVERN_GRAIN / pagesize);
+    memregion *regions;
+    uint64_t total = 0;
+    int nfiles, nregions = 0, i, r;
+
+    uint32_t tick = __atomic_add_fetch(&kv->govtick, 1, __ATOMIC_RELAXED);
+    nfiles = __atomic_load_n(&kv->nfiles, __ATOMIC_ACQUIRE);
+    regions = (memregion *) malloc(nfiles * GOVERN_REGIONS * sizeof(memregion));
+
+    for (i=0; i < nfiles; i++) {
+        for (r=0; r < GOVERN_REGIONS; r++) {
+            char *addr = (char *) kv->filemaps[i] + (uint64_t) r * GOVERN_GRAIN;
+            uint64_t n = 0, p;
+            if (mincore(addr, GOVERN_GRAIN, vec) == 0) {
+                for (p=0; p < GOVERN_GRAIN / pagesize; p++) {
+                    n += vec[p] & 1;
+                }
+            }
+            kv->resident[i][r] = n * pagesize;
+            if (n == 0) {
+                continue;
+            }
+            total += n * pagesize;
+
+            uint32_t touched = __atomic_load_n(&kv->touched[i][r], __ATOMIC_RELAXED);
+#ifdef MADV_COLD
+            if (tick - touched == GOVERN_COLD) {
+                madvise(addr, GOVERN_GRAIN, MADV_COLD);
+            }
+#endif
+            regions[nregions].num = i;
+            regions[nregions].region = r;
+            regions[nregions].touched = touched;
+            nregions++;
+        }
+    }
+
+    size_t budget = __atomic_load_n(&kv->membudget, __ATOMIC_RELAXED);
+    if (budget && total > budget) {
+        qsort(regions, nregions, sizeof(memregion), memregion_cmp);
+        for (i=0; i < nregions && total > budget / 100 * GOVERN_LOW; i++) {
+            uint64_t bytes = kv->resident[regions[i].num][regions[i].region];
+            mem_pageout(kv, regions[i].num, regions[i].region);
+            debug_log("Operation:Govern, paged out %"PRIu64" bytes of region %d:%d", bytes, regions[i].num, regions[i].region);
+            kv->resident[regions[i].num][regions[i].region] = 0;
+            total -= bytes;
+            __atomic_add_fetch(&kv->memreclaimed, bytes, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&kv->memresident, total, __ATOMIC_RELAXED);
+
+    free(regions);
+    free(vec);
+}
+
+static void *governor_main(void *arg) {
+    lightkv *kv = (lightkv *) arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&kv->govlock);
+    while (!kv->governor_stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += GOVERN_INTERVAL / 1000;
+        ts.tv_nsec += (GOVERN_INTERVAL % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&kv->govwake, &kv->govlock, &ts);
+        if (kv->governor_stop) {
+            break;
+        }
+
+        pthread_mutex_unlock(&kv->govlock);
+        governor_pass(kv);
+        pthread_mutex_lock(&kv->govlock);
+    }
+    pthread_mutex_unlock(&kv->govlock);
+
+    return NULL;
+}
+#endif
+
+int lightkv_set_membudget(lightkv *kv, size_t size) {
+#ifdef USE_MMAP
+    __atomic_store_n(&kv->membudget, size, __ATOMIC_RELAXED);
+    if (size && !kv->governor_on) {
+        kv->governor_on = pthread_create(&kv->governor, NULL, governor_main, kv) == 0;
+    }
+    return kv->governor_on || size == 0 ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+void lightkv_mem_stats(lightkv *kv, uint64_t *resident, uint64_t *reclaimed) {
+    *resident = __atomic_load_n(&kv->memresident, __ATOMIC_RELAXED);
+    *reclaimed = __atomic_load_n(&kv->memreclaimed, __ATOMIC_RELAXED);
+}
+
+// Record cache
+//
+// Shards are picked by a hash of the recid and each runs S3-FIFO: records
+// enter a small queue, and only those hit while there move to the main
+// queue, which gives records a further round per hit before they go. Records
+// evicted from the small queue unhit leave a ghost, and coming back while
+// it lasts puts them in main directly. A reader takes the invalidation count
+// of the shard before going to disk and only fills the cache if no write
+// invalidated the shard meanwhile.
+
+static uint64_t cache_hash(uint64_t recid) {
+    return recid * 0x9e3779b97f4a7c15ULL;
+}
+
+static cacheshard *cache_shard(lightkv *kv, uint64_t recid) {
+    return &kv->cache[(cache_hash(recid) >> 32) % CACHE_SHARDS];
+}
+
+static cacheent **cache_bucket(cacheshard *s, uint64_t recid) {
+    uint64_t h = cache_hash(recid);
+    return &s->table[(h ^ (h >> 29)) & s->tmask];
+}
+
+static cacheent *cache_find(cacheshard *s, uint64_t recid) {
+    cacheent *e;
+
+    for (e = *cache_bucket(s, recid); e; e = e->hnext) {
+        if (e->recid == recid) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void cacheq_push(cachequeue *q, cacheent *e) {
+    e->prev = NULL;
+    e->next = q->head;
+    if (q->head) {
+        q->head->prev = e;
+    } else {
+        q->tail = e;
+    }
+    q->head = e;
+    q->bytes += e->size;
+    q->count++;
+}
+
+static void cacheq_remove(cachequeue *q, cacheent *e) {
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        q->head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        q->tail = e->prev;
+    }
+    q->bytes -= e->size;
+    q->count--;
+}
+
+// Unlink e from its queue and the table and free it, shard lock held
+static void cache_drop(cacheshard *s, cacheent *e) {
+    cacheent **p = cache_bucket(s, e->recid);
+
+    while (*p != e) {
+        p = &(*p)->hnext;
+    }
+    *p = e->hnext;
+    cacheq_remove(&s->q[e->queue], e);
+    free(e->rec);
+    free(e);
+}
+
+// Double the table once it holds more entries than buckets, shard lock held
+static void cache_grow(cacheshard *s) {
+    uint64_t n = s->q[CACHE_SMALL].count + s->q[CACHE_MAIN].count + s->q[CACHE_GHOST].count;
+    uint64_t i, old = s->tmask + 1;
+    cacheent **table = s->table;
+
+    if (n <= old) {
+        return;
+    }
+
+    s->tmask = old * 2 - 1;
+    s->table = (cacheent **) calloc(old * 2, sizeof(cacheent *));
+    for (i=0; i < old; i++) {
+        while (table[i]) {
+            cacheent *e = table[i];
+            table[i] = e->hnext;
+            cacheent **b = cache_bucket(s, e->recid);
+            e->hnext = *b;
+            *b = e;
+        }
+    }
+    free(table);
+}
+
+// Evict till the shard fits its budget, shard lock held
+static void cache_evict(cacheshard *s) {
+    cachequeue *small = &s->q[CACHE_SMALL], *main = &s->q[CACHE_MAIN], *ghost = &s->q[CACHE_GHOST];
+    cacheent *e;
+
+    while (small->bytes + main->bytes > s->budget) {
+        if (small->bytes > s->budget / 100 * CACHE_SMALLFRAC || main->count == 0) {
+            e = small->tail;
+            cacheq_remove(small, e);
+            if (e->freq) {
+                e->freq = 0;
+                e->queue = CACHE_MAIN;
+                cacheq_push(main, e);
+            } else {
+                // Seen once, only its recid is remembered
+                free(e->rec);
+                e->rec = NULL;
+                e->size = 0;
+                e->queue = CACHE_GHOST;
+                cacheq_push(ghost, e);
+            }
+        } else {
+            e = main->tail;
+            if (e->freq) {
+                cacheq_remove(main, e);
+                e->freq--;
+                cacheq_push(main, e);
+            } else {
+                cache_drop(s, e);
+            }
+        }
+    }
+
+    // Ghosts cover about as many records as the shard holds
+    while (ghost->count > main->count + small->count) {
+        cache_drop(s, ghost->tail);
+    }
+}
+
+static bool cache_get(lightkv *kv, uint64_t recid, char **key, char **val, uint32_t *len) {
+    cacheshard *s = cache_shard(kv, recid);
+    cacheent *e;
+
+    pthread_mutex_lock(&s->lock);
+    e = cache_find(s, recid);
+    if (e == NULL || e->queue == CACHE_GHOST || record_expired(e->rec)) {
+        s->misses++;
+        pthread_mutex_unlock(&s->lock);
+        return false;
+    }
+
+    if (e->freq < CACHE_MAXFREQ) {
+        e->freq++;
+    }
+    s->hits++;
+    if (!(e->rec->flags & RECORD_COMPRESSED)) {
+        *key = get_key(e->rec);
+        *len = get_val(e->rec, val);
+        pthread_mutex_unlock(&s->lock);
+        return true;
+    }
+
+    // Decompress a copy outside of the lock
+    record *rec = (record *) malloc(e->rec->len);
+    memcpy(rec, e->rec, e->rec->len);
+    pthread_mutex_unlock(&s->lock);
+    *key = get_key(rec);
+    *len = record_value(kv, rec, val);
+    free(rec);
+    if (*val == NULL) {
+        free(*key);
+        return false;
+    }
+    return true;
+}
+
+static uint64_t cache_ticket(lightkv *kv, uint64_t recid) {
+    return __atomic_load_n(&cache_shard(kv, recid)->inval, __ATOMIC_ACQUIRE);
+}
+
+static void cache_put(lightkv *kv, uint64_t recid, const record *rec, uint64_t ticket) {
+    cacheshard *s = cache_shard(kv, recid);
+    uint32_t size = rec->len + sizeof(cacheent);
+    cacheent *e;
+
+    if (size > s->budget / 8) {
+        return;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    e = cache_find(s, recid);
+    if (s->inval != ticket || (e && e->queue != CACHE_GHOST)) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+
+    if (e) {
+        // Evicted recently and back already
+        cacheq_remove(&s->q[CACHE_GHOST], e);
+        e->queue = CACHE_MAIN;
+    } else {
+        e = (cacheent *) malloc(sizeof(cacheent));
+        e->recid = recid;
+        e->queue = CACHE_SMALL;
+        cacheent **b = cache_bucket(s, recid);
+        e->hnext = *b;
+        *b = e;
+    }
+    e->rec = (record *) malloc(rec->len);
+    memcpy(e->rec, rec, rec->len);
+    e->size = size;
+    e->freq = 0;
+    cacheq_push(&s->q[e->queue], e);
+
+    cache_evict(s);
+    cache_grow(s);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void cache_invalidate(lightkv *kv, uint64_t recid) {
+    if (kv->cache == NULL) {
+        return;
+    }
+
+    cacheshard *s = cache_shard(kv, recid);
+    pthread_mutex_lock(&s->lock);
+    cacheent *e = cache_find(s, recid);
+    if (e && e->queue != CACHE_GHOST) {
+        cache_drop(s, e);
+    }
+    __atomic_store_n(&s->inval, s->inval + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void cache_free(lightkv *kv) {
+    int i, q;
+
+    if (kv->cache == NULL) {
+        return;
+    }
+    for (i=0; i < CACHE_SHARDS; i++) {
+        cacheshard *s = &kv->cache[i];
+        for (q=0; q < 3; q++) {
+            while (s->q[q].head) {
+                cache_drop(s, s->q[q].head);
+            }
+        }
+        free(s->table);
+        pthread_mutex_destroy(&s->lock);
+    }
+    free(kv->cache);
+    kv->cache = NULL;
+}
+
+int lightkv_set_cache(lightkv *kv, size_t size) {
+#ifdef USE_MMAP
+    return -1;
+#else
+    int i;
+
+    cache_free(kv);
+    if (size == 0) {
+        return 0;
+    }
+
+    kv->cache = (cacheshard *) calloc(CACHE_SHARDS, sizeof(cacheshard));
+    for (i=0; i < CACHE_SHARDS; i++) {
+        cacheshard *s = &kv->cache[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->tmask = 1023;
+        s->table = (cacheent **) calloc(s->tmask + 1, sizeof(cacheent *));
+        s->budget = size / CACHE_SHARDS;
+    }
+    return 0;
+#endif
+}
+
+void lightkv_cache_stats(lightkv *kv, uint64_t *hits, uint64_t *misses) {
+    int i;
+
+    *hits = 0;
+    *misses = 0;
+    for (i=0; kv->cache && i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&kv->cache[i].lock);
+        *hits += kv->cache[i].hits;
+        *misses += kv->cache[i].misses;
+        pthread_mutex_unlock(&kv->cache[i].lock);
+    }
+}
+
+// Hot/cold tiering
+//
+// Reads are sampled per thread with a xorshift, so they do not alias with
+// access patterns, into a small table of saturating counters hashed by
+// recid. A record is queued on every TIER_HOT counts, and the migrator
+// copies queued records into a chunk of the tail it owns and deletes the
+// originals. The grains its chunks cover are remembered, so records there
+// stay put; the map is lost on close and records may move once more after
+// an open. Each pass halves the counters, so heat follows recent reads.
+// Writes to existing slots hold movelock shared and check the slot still
+// holds a VAL, the migrator rechecks and deletes an original exclusive, so
+// a write is either seen by the recheck or refused. The slot left behind
+// is not reused till close, so a stale recid never reaches another record.
+
+static void tier_sample(lightkv *kv, uint64_t recid) {
+    uint8_t *heat = __atomic_load_n(&kv->heat, __ATOMIC_ACQUIRE);
+    if (heat == NULL) {
+        return;
+    }
+
+    arena *a = arena_get(kv);
+    uint32_t x = a->tierrand;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    a->tierrand = x;
+    if (x & (TIER_SAMPLE - 1)) {
+        return;
+    }
+
+    // Increments lost to racing readers only delay a record
+    uint8_t *h = &heat[cache_hash(recid) >> (64 - TIER_HEATBITS)];
+    uint8_t n = __atomic_load_n(h, __ATOMIC_RELAXED);
+    if (n == UINT8_MAX) {
+        return;
+    }
+    __atomic_store_n(h, ++n, __ATOMIC_RELAXED);
+
+    if (n % TIER_HOT == 0) {
+        uint64_t i = __atomic_fetch_add(&kv->tierhead, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&kv->tierq[i % TIER_QUEUE], recid, __ATOMIC_RELEASE);
+    }
+}
+
+static bool tier_ishot(lightkv *kv, loc l) {
+    uint32_t g = l.l.offset / TIER_GRAIN;
+    return kv->hotmap[l.l.num][g / 64] & (1ULL << (g % 64));
+}
+
+// Lay out the unused rest of the chunk as free slots, like arena_retire
+static void tier_retire(lightkv *kv) {
+    while (kv->tiercap - kv->tierused >= RECORD_HEADER_SIZE) {
+        uint32_t piece = free_piece(kv->tiercap - kv->tierused);
+
+        loc l = kv->tierbase;
+        l.l.offset += kv->tierused;
+        l.l.sclass = get_sizeslot(piece);
+
+        record rh;
+        memset(&rh, 0, sizeof(rh));
+        rh.type = RECORD_DEL;
+        rh.len = piece;
+        rh.crc = record_crc(&rh);
+        write_buf(kv, l, (char *) &rh, RECORD_HEADER_SIZE);
+        freelist_push(kv, l);
+        kv->tierused += piece;
+    }
+    kv->tiercap = 0;
+    kv->tierused = 0;
+}
+
+// Grains the chunk shares with arenas are taken as hot as a whole
+static void tier_newchunk(lightkv *kv) {
+    uint32_t g;
+
+    tier_retire(kv);
+    kv->tierbase = take_tailloc(kv, kv->chunksize);
+    kv->tierbase.l.sclass = 0;
+    kv->tiercap = kv->chunksize;
+
+    for (g = kv->tierbase.l.offset / TIER_GRAIN; g <= (kv->tierbase.l.offset + kv->tiercap - 1) / TIER_GRAIN; g++) {
+        kv->hotmap[kv->tierbase.l.num][g / 64] |= 1ULL << (g % 64);
+    }
+}
+
+static bool tier_move(lightkv *kv, loc l, loc *to) {
+    record *rec;
+
+    lightkv_read_begin(kv);
+    read_record(kv, l, &rec);
+    lightkv_read_end(kv);
+
+    // Queued recids may be stale, only a whole record of the slot moves.
+    // Records too large for arenas have pages of their own already.
+    uint32_t rsize = roundsize(rec->len);
+    if (rec->type != RECORD_VAL || rec->len < RECORD_HEADER_SIZE || get_sizeslot(rsize) != l.l.sclass ||
+            rsize > kv->chunksize / ARENA_MAXFRAC || !verify_record(rec)) {
+        free(rec);
+        return false;
+    }
+
+    uint32_t was = rec->seqno, expiry = record_expiry(rec);
+    uint64_t seqno = next_seqno(kv, 1);
+    rec->seqno = (uint32_t) seqno;
+    rec->crc = record_crc(rec);
+
+    if (kv->tiercap - kv->tierused < rsize) {
+        tier_newchunk(kv);
+    }
+    *to = kv->tierbase;
+    to->l.offset += kv->tierused;
+    to->l.sclass = l.l.sclass;
+    kv->tierused += rsize;
+
+    bool written = write_record(kv, *to, rec) >= 0;
+    uint64_t lsn = written ? wal_append(kv, *to, (char *) rec, rec->len) : WAL_FAILED;
     free(rec);
+    if (!wal_commit(kv, lsn)) {
+        // The original stays, the copy was never seen
+        publish_change(kv, seqno, *to, RECORD_VAL);
+        delete_slot(kv, *to);
+        return false;
+    }
+
+    // Written while being copied, the copy goes instead. The copy is only
+    // published once the original is gone, so nothing writes it before.
+    pthread_rwlock_wrlock(&kv->movelock);
+    record rh = read_recheader(kv, l);
+    bool same = rh.type == RECORD_VAL && rh.seqno == was;
+    if (same) {
+        same = tombstone_slot(kv, l, &lsn);
+    }
+    if (same) {
+        kv->forwarded = freelist_add(kv->forwarded, freeloc_new(l));
+    }
+    pthread_rwlock_unlock(&kv->movelock);
+    publish_change(kv, seqno, *to, RECORD_VAL);
+    if (!same) {
+        wal_commit(kv, delete_slot(kv, *to));
+        return false;
+    }
+    wal_commit(kv, lsn);
+    if (expiry) {
+        expire_add(kv, *to, expiry);
+    }
+    return true;
+}
+
+int lightkv_tier_pass(lightkv *kv) {
+    uint64_t i, head;
+    loc l, to;
+    int n = 0;
+
+    pthread_mutex_lock(&kv->tierlock);
+    if (kv->moved == NULL) {
+        pthread_mutex_unlock(&kv->tierlock);
+        return 0;
+    }
+
+    // A slot not written yet holds an older recid, which is skipped or
+    // moves early
+    head = __atomic_load_n(&kv->tierhead, __ATOMIC_RELAXED);
+    if (head - kv->tiertail > TIER_QUEUE) {
+        kv->tiertail = head - TIER_QUEUE;
+    }
+    for (i = kv->tiertail; i < head; i++) {
+        l.val = __atomic_load_n(&kv->tierq[i % TIER_QUEUE], __ATOMIC_ACQUIRE);
+        if (l.val == 0 || tier_ishot(kv, l) || !tier_move(kv, l, &to)) {
+            continue;
+        }
+        debug_log("Operation:Tier, moved target:"LOCSTR" to "LOCSTR, LOCPARAMS(l), LOCPARAMS(to));
+        kv->moved(l.val, to.val, kv->movedctx);
+        n++;
+    }
+    kv->tiertail = head;
+    __atomic_add_fetch(&kv->tiermoved, n, __ATOMIC_RELAXED);
+
+    for (i=0; i < 1 << TIER_HEATBITS; i++) {
+        uint8_t h = __atomic_load_n(&kv->heat[i], __ATOMIC_RELAXED);
+        if (h) {
+            __atomic_store_n(&kv->heat[i], h >> 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&kv->tierlock);
+
+    return n;
+}
+
+static bool tier_hold(lightkv *kv) {
+    // Setup calls are not thread safe, so tiering cannot start meanwhile
+    if (__atomic_load_n(&kv->heat, __ATOMIC_ACQUIRE) == NULL) {
+        return false;
+    }
+    pthread_rwlock_rdlock(&kv->movelock);
+    return true;
+}
+
+static void tier_release(lightkv *kv, bool held) {
+    if (held) {
+        pthread_rwlock_unlock(&kv->movelock);
+    }
+}
+
+static void *migrator_main(void *arg) {
+    lightkv *kv = (lightkv *) arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&kv->tierlock);
+    while (!kv->migrator_stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += kv->tierinterval / 1000;
+        ts.tv_nsec += (kv->tierinterval % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&kv->tierwake, &kv->tierlock, &ts);
+        if (kv->migrator_stop) {
+            break;
+        }
+
+        pthread_mutex_unlock(&kv->tierlock);
+        lightkv_tier_pass(kv);
+        pthread_mutex_lock(&kv->tierlock);
+    }
+    pthread_mutex_unlock(&kv->tierlock);
+
+    return NULL;
+}
+
+int lightkv_set_tiering(lightkv *kv, lightkv_moved moved, void *ctx) {
+    pthread_mutex_lock(&kv->tierlock);
+    if (moved && kv->heat == NULL) {
+        kv->tierq = (uint64_t *) calloc(TIER_QUEUE, sizeof(uint64_t));
+        __atomic_store_n(&kv->heat, (uint8_t *) calloc(1 << TIER_HEATBITS, 1), __ATOMIC_RELEASE);
+    }
+    kv->moved = moved;
+    kv->movedctx = ctx;
+    pthread_mutex_unlock(&kv->tierlock);
+
+    // Without an interval passes are left to lightkv_tier_pass
+    if (moved && kv->tierinterval && !kv->migrator_on) {
+        kv->migrator_on = pthread_create(&kv->migrator, NULL, migrator_main, kv) == 0;
+    }
+    return kv->migrator_on || moved == NULL || kv->tierinterval == 0 ? 0 : -1;
+}
+
+void lightkv_set_tier_interval(lightkv *kv, uint32_t ms) {
+    kv->tierinterval = ms;
+}
+
+void lightkv_tier_stats(lightkv *kv, uint64_t *queued, uint64_t *moved) {
+    *queued = __atomic_load_n(&kv->tierhead, __ATOMIC_RELAXED);
+    *moved = __atomic_load_n(&kv->tiermoved, __ATOMIC_RELAXED);
+}
+
+// Record expiry
+//
+// Records written with a ttl carry their expiry time after the key and
+// read as missing from then on. Their recids wait in a hierarchical timer
+// wheel: level n has WHEEL_SLOTS slots of WHEEL_SLOTS^n seconds, and an
+// expiry goes to the lowest level whose slot above it is the current one,
+// so it cascades down as its time nears and reaches due exactly on its
+// second. Due records are deleted a few at a time by writes. Entries are
+// not removed when their record changes; a due entry deletes its slot only
+// if that still holds a record with the same expiry. Pending entries are
+// kept in the superblock, and recovery and log replay find the others.
+
+static uint32_t record_expiry(const record *rec) {
+    uint32_t expiry = 0;
+    if (rec->flags & RECORD_EXPIRES) {
+        memcpy(&expiry, (const char *) rec + RECORD_HEADER_SIZE + rec->extlen, sizeof(expiry));
+    }
+    return expiry;
+}
+
+static bool record_expired(const record *rec) {
+    return (rec->flags & RECORD_EXPIRES) && record_expiry(rec) <= (uint32_t) time(NULL);
+}
+
+static void wheel_insert(lightkv *kv, expent *e) {
+    int level;
+
+    if (e->expiry <= kv->wheelnow) {
+        e->next = kv->due;
+        kv->due = e;
+        return;
+    }
+
+    for (level=0; level < WHEEL_LEVELS - 1; level++) {
+        int shift = WHEEL_BITS * (level + 1);
+        if (e->expiry >> shift == kv->wheelnow >> shift) {
+            break;
+        }
+    }
+    expent **slot = &kv->wheel[level][(e->expiry >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    e->next = *slot;
+    *slot = e;
+}
+
+static void wheel_advance(lightkv *kv, uint32_t now) {
+    int level;
+
+    // Nothing waits in the wheel, jump
+    if (__atomic_load_n(&kv->nexpiring, __ATOMIC_RELAXED) == 0 && now > kv->wheelnow) {
+        kv->wheelnow = now;
+    }
+
+    while (kv->wheelnow < now) {
+        uint32_t t = ++kv->wheelnow;
+
+        // Slots whose span starts now cascade, the level 0 one is due
+        for (level = WHEEL_LEVELS - 1; level >= 0; level--) {
+            if (t & ((1U << (WHEEL_BITS * level)) - 1)) {
+                continue;
+            }
+            expent **slot = &kv->wheel[level][(t >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+            expent *e = *slot, *next;
+            *slot = NULL;
+            for (; e; e = next) {
+                next = e->next;
+                wheel_insert(kv, e);
+            }
+        }
+    }
+}
+
+static void expire_add(lightkv *kv, loc l, uint32_t expiry) {
+    expent *e = (expent *) malloc(sizeof(expent));
+    e->recid = l.val;
+    e->expiry = expiry;
+
+    pthread_mutex_lock(&kv->wheellock);
+    wheel_insert(kv, e);
+    __atomic_add_fetch(&kv->nexpiring, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&kv->wheellock);
+}
+
+static int expire_step(lightkv *kv, int max, bool wait) {
+    char peek[RECORD_HEADER_SIZE + UINT8_MAX + sizeof(uint32_t)];
+    record *rec = (record *) peek;
+    int i, n = 0;
+
+    if (wait) {
+        pthread_mutex_lock(&kv->wheellock);
+    } else if (pthread_mutex_trylock(&kv->wheellock)) {
+        return 0;
+    }
+
+    wheel_advance(kv, (uint32_t) time(NULL));
+    for (i=0; i < max && kv->due; i++) {
+        expent *e = kv->due;
+        kv->due = e->next;
+        __atomic_sub_fetch(&kv->nexpiring, 1, __ATOMIC_RELAXED);
+
+        // The slot may hold another record by now
+        loc l;
+        l.val = e->recid;
+        size_t got = 0;
+        bool held = tier_hold(kv);
+        if (l.l.num < __atomic_load_n(&kv->nfiles, __ATOMIC_ACQUIRE)) {
+#ifndef USE_MMAP
+            arena_read_barrier(kv, l, sizeof(peek));
+#endif
+            got = read_direct(kv, l.l.num, l.l.offset, peek, sizeof(peek));
+        }
+        if (got >= RECORD_HEADER_SIZE && rec->type == RECORD_VAL && (rec->flags & RECORD_EXPIRES) &&
+                got >= val_offset(rec) && record_expiry(rec) == e->expiry &&
+                get_sizeslot(roundsize(rec->len)) == l.l.sclass) {
+            debug_log("Operation:Expire, target:"LOCSTR" expired at %u", LOCPARAMS(l), e->expiry);
+            uint64_t lsn = delete_slot(kv, l);
+            tier_release(kv, held);
+            wal_commit(kv, lsn);
+            n++;
+        } else {
+            tier_release(kv, held);
+        }
+        free(e);
+    }
+    pthread_mutex_unlock(&kv->wheellock);
+
+    __atomic_add_fetch(&kv->nexpired, n, __ATOMIC_RELAXED);
+    return n;
+}
+
+int lightkv_expire(lightkv *kv, int max) {
+    return expire_step(kv, max, true);
+}
+
+void lightkv_expire_stats(lightkv *kv, uint64_t *pending, uint64_t *expired) {
+    *pending = __atomic_load_n(&kv->nexpiring, __ATOMIC_RELAXED);
+    *expired = __atomic_load_n(&kv->nexpired, __ATOMIC_RELAXED);
+}
+
+// Change feed
+//
+// Every change takes the next sequence number, which also goes into its
+// record header. Recent changes sit in a ring indexed by seqno; a writer
+// claims its slot by swapping in CHANGE_BUSY and publishes the seqno last,
+// and never waits for readers. A newer change in a slot means the one
+// asked for was dropped.
+
+static uint64_t next_seqno(lightkv *kv, uint64_t n) {
+    return __atomic_add_fetch(&kv->seqno, n, __ATOMIC_RELAXED) - n + 1;
+}
+
+static void note_seqno(lightkv *kv, uint32_t low) {
+    uint64_t cur = __atomic_load_n(&kv->seqno, __ATOMIC_RELAXED);
+
+    // Serial number arithmetic on the low bits, ahead by less than 2^31
+    while ((int32_t) (low - (uint32_t) cur) > 0) {
+        uint64_t seen = cur + (uint32_t) (low - (uint32_t) cur);
+        if (__atomic_compare_exchange_n(&kv->seqno, &cur, seen, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+static void publish_change(lightkv *kv, uint64_t seqno, loc l, uint8_t type) {
+    if (kv->changes == NULL) {
+        return;
+    }
+
+    changeslot *c = &kv->changes[seqno & kv->changemask];
+    uint64_t cur = __atomic_load_n(&c->seqno, __ATOMIC_ACQUIRE);
+    do {
+        if (cur == CHANGE_BUSY) {
+            sched_yield();
+            cur = __atomic_load_n(&c->seqno, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        // Lapped by a newer change already
+        if (cur > seqno) {
+            return;
+        }
+    } while (cur == CHANGE_BUSY ||
+            !__atomic_compare_exchange_n(&c->seqno, &cur, CHANGE_BUSY, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    __atomic_store_n(&c->recid, l.val, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->type, type, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->seqno, seqno, __ATOMIC_RELEASE);
+}
+
+uint64_t lightkv_seqno(lightkv *kv) {
+    return __atomic_load_n(&kv->seqno, __ATOMIC_ACQUIRE);
+}
+
+int lightkv_set_changefeed(lightkv *kv, uint32_t n) {
+    free(kv->changes);
+    kv->changes = NULL;
+    if (n == 0) {
+        return 0;
+    }
+
+    uint64_t size = 1;
+    while (size < n) {
+        size <<= 1;
+    }
+    kv->changes = (changeslot *) calloc(size, sizeof(changeslot));
+    kv->changemask = size - 1;
+    kv->changestart = kv->seqno + 1;
+    return 0;
+}
+
+int lightkv_changes(lightkv *kv, uint64_t after, lightkv_change *out, int max) {
+    int n = 0;
+
+    if (kv->changes == NULL || after + 1 < kv->changestart) {
+        return -1;
+    }
+
+    while (n < max) {
+        uint64_t want = after + n + 1;
+        changeslot *c = &kv->changes[want & kv->changemask];
+        uint64_t seqno = __atomic_load_n(&c->seqno, __ATOMIC_ACQUIRE);
+        if (seqno == CHANGE_BUSY || seqno < want) {
+            break;
+        }
+        if (seqno > want) {
+            return n ? n : -1;
+        }
+
+        out[n].seqno = want;
+        out[n].recid = __atomic_load_n(&c->recid, __ATOMIC_RELAXED);
+        out[n].type = __atomic_load_n(&c->type, __ATOMIC_RELAXED);
+        // Rewritten while copying, it is gone or about to be
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&c->seqno, __ATOMIC_RELAXED) != want) {
+            return n ? n : -1;
+        }
+        n++;
+    }
+
+    return n;
+}
+
+// Atomic batches
+//
+// Slots are allocated as writes are added so their recids are known up
+// front. On commit the images are logged as one group and flushed once,
+// then written to the data files. A batch holds batchlock shared from
+// logging till applied, so a checkpoint never drops a log whose batch is
+// only partly on disk; replay skips a group cut short by a crash.
+
+lightkv_batch *lightkv_batch_begin(lightkv *kv) {
+    lightkv_batch *b = (lightkv_batch *) malloc(sizeof(lightkv_batch));
+    b->store = kv;
+    b->nops = 0;
+    b->cap = 8;
+    b->ops = (batchop *) malloc(b->cap * sizeof(batchop));
+    return b;
+}
+
+static batchop *batch_add(lightkv_batch *b, loc l, record *rec, uint32_t len) {
+    if (b->nops == b->cap) {
+        b->cap *= 2;
+        b->ops = (batchop *) realloc(b->ops, b->cap * sizeof(batchop));
+    }
+
+    batchop *op = &b->ops[b->nops];
+    op->l = l;
+    op->rec = rec;
+    op->len = len;
+    op->seq = b->nops++;
+    op->fresh = false;
+    op->release = false;
+    return op;
+}
+
+uint64_t lightkv_batch_put(lightkv_batch *b, const char *key, const char *val, uint32_t len) {
+    record *rec = create_value(b->store, key, val, len, 0, 0);
+    loc l = find_freeloc(b->store, roundsize(rec->len));
+
+    batch_add(b, l, rec, rec->len)->fresh = true;
+    debug_log("Operation:BatchPut, key:%s at target:"LOCSTR, key, LOCPARAMS(l));
+    return l.val;
+}
+
+uint64_t lightkv_batch_update(lightkv_batch *b, uint64_t recid, const char *key, const char *val, uint32_t len) {
+    loc l;
+    l.val = recid;
+
+    // A new slot also when shrinking out of the size class, as in lightkv_update
+    record *rec = create_value(b->store, key, val, len, 0, 0);
+    if (get_sizeslot(roundsize(rec->len)) != l.l.sclass) {
+        lightkv_batch_delete(b, recid);
+        l = find_freeloc(b->store, roundsize(rec->len));
+        batch_add(b, l, rec, rec->len)->fresh = true;
+    } else {
+        batch_add(b, l, rec, rec->len);
+    }
+
+    debug_log("Operation:BatchUpdate, key:%s at target:"LOCSTR, key, LOCPARAMS(l));
+    return l.val;
+}
+
+bool lightkv_batch_delete(lightkv_batch *b, uint64_t recid) {
+    loc l;
+    l.val = recid;
+
+    record *rec = create_record(RECORD_DEL, NULL, NULL, 0, get_slotsize(l.l.sclass), 0);
+    batch_add(b, l, rec, RECORD_HEADER_SIZE)->release = true;
+    return true;
+}
+
+static int batchop_cmp(const void *x, const void *y) {
+    const batchop *a = (const batchop *) x, *b = (const batchop *) y;
+
+    if (a->l.l.num != b->l.l.num) {
+        return a->l.l.num < b->l.l.num ? -1 : 1;
+    }
+    if (a->l.l.offset != b->l.l.offset) {
+        return a->l.l.offset < b->l.l.offset ? -1 : 1;
+    }
+    return a->seq < b->seq ? -1 : 1;
+}
+
+#ifndef USE_MMAP
+// Does [l, l+len) touch the buffered chunk of some arena?
+static bool arenas_overlap(lightkv *kv, loc l, size_t len) {
+    arena *a;
+
+    if (!kv->buffered) {
+        return false;
+    }
+    for (a = __atomic_load_n(&kv->arenas, __ATOMIC_ACQUIRE); a; a = a->next) {
+        if (arena_overlaps(a, l.l.num, l.l.offset, len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char batch_zeros[4096];
+#endif
+
+static bool batch_apply(lightkv *kv, batchop *ops, size_t n) {
+    size_t i = 0;
+    bool ok = true;
+
+    // Sorted by location, writes to one slot stay in batch order
+    qsort(ops, n, sizeof(batchop), batchop_cmp);
+
+#ifdef USE_MMAP
+    for (i=0; i < n; i++) {
+        if (write_direct(kv, ops[i].l, (char *) ops[i].rec, ops[i].len) < 0) {
+            ok = false;
+        }
+    }
+#else
+    struct iovec iov[IOV_MAX];
+
+    while (i < n) {
+        // Arena chunks have to see writes into them
+        if (arenas_overlap(kv, ops[i].l, ops[i].len)) {
+            if (write_buf(kv, ops[i].l, (char *) ops[i].rec, ops[i].len) < 0) {
+                ok = false;
+            }
+            i++;
+            continue;
+        }
+
+        size_t first = i;
+        loc start = ops[i].l;
+        uint64_t end = start.l.offset;
+        int niov = 0;
+        while (i < n && niov < IOV_MAX - 1 && ops[i].l.l.num == start.l.num &&
+                ops[i].l.l.offset == end && !arenas_overlap(kv, ops[i].l, ops[i].len)) {
+            iov[niov].iov_base = ops[i].rec;
+            iov[niov].iov_len = ops[i].len;
+            niov++;
+            end += ops[i].len;
+
+            // Small slack up to an adjacent slot is zeroed to keep the run going
+            uint64_t next = ops[i].l.l.offset + get_slotsize(ops[i].l.l.sclass);
+            i++;
+            if (i < n && ops[i].l.l.num == start.l.num && ops[i].l.l.offset == next &&
+                    next - end <= sizeof(batch_zeros) && next > end) {
+                iov[niov].iov_base = (void *) batch_zeros;
+                iov[niov].iov_len = next - end;
+                niov++;
+                end = next;
+            }
+        }
+        if (pwritev(kv->fds[start.l.num], iov, niov, start.l.offset) == (ssize_t) (end - start.l.offset)) {
+            mark_dirty(kv, start.l.num, start.l.offset, end - start.l.offset);
+            continue;
+        }
+        // Short or failed, the run goes again a record at a time
+        size_t j;
+        for (j=first; j < i; j++) {
+            if (write_direct(kv, ops[j].l, (char *) ops[j].rec, ops[j].len) < 0) {
+                ok = false;
+            }
+        }
+    }
+#endif
+    return ok;
+}
+
+static void batch_free(lightkv_batch *b) {
+    size_t i;
+
+    for (i=0; i < b->nops; i++) {
+        free(b->ops[i].rec);
+    }
+    free(b->ops);
+    free(b);
+}
+
+static bool batch_fresh(const batchop *ops, size_t n, loc l) {
+    size_t i;
+    for (i=0; i < n; i++) {
+        if (ops[i].fresh && ops[i].l.val == l.val) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool lightkv_batch_commit(lightkv_batch *b) {
+    lightkv *kv = b->store;
+    size_t i;
+
+    debug_log("Operation:BatchCommit, %zu writes", b->nops);
+    if (b->nops == 0) {
+        batch_free(b);
+        return true;
+    }
+
+    // Turning the log on is a setup call, not safe against running writers
+    if (__atomic_load_n(&kv->walfd, __ATOMIC_ACQUIRE) < 0) {
+        debug_log("Operation:BatchCommit, no write ahead log for %zu writes", b->nops);
+        lightkv_batch_abort(b);
+        return false;
+    }
+
+    arena *a = arena_get(kv);
+    int level = a->durability == LIGHTKV_DURABLE_DEFAULT ? kv->durability : a->durability;
+
+    // A record moved away since the batch was built fails it
+    bool held = tier_hold(kv);
+    for (i=0; held && i < b->nops; i++) {
+        if (!b->ops[i].fresh && read_recheader(kv, b->ops[i].l).type != RECORD_VAL &&
+                !batch_fresh(b->ops, b->nops, b->ops[i].l)) {
+            tier_release(kv, held);
+            lightkv_batch_abort(b);
+            return false;
+        }
+    }
+
+    // Sequence numbers are taken on commit so aborted batches leave no holes
+    uint64_t seqno = next_seqno(kv, b->nops);
+    for (i=0; i < b->nops; i++) {
+        b->ops[i].rec->seqno = (uint32_t) (seqno + i);
+        b->ops[i].rec->crc = record_crc(b->ops[i].rec);
+    }
+
+    pthread_rwlock_rdlock(&kv->batchlock);
+    uint64_t lsn = wal_append_batch(kv, b->ops, b->nops);
+    // The whole group reaches the OS before any of it reaches a data file
+    if (!wal_flush(kv, lsn, level > LIGHTKV_DURABLE_OS ? level : LIGHTKV_DURABLE_OS)) {
+        pthread_rwlock_unlock(&kv->batchlock);
+        tier_release(kv, held);
+        // Seqnos are taken, records left as they were read as changed
+        for (i=0; i < b->nops; i++) {
+            publish_change(kv, seqno + b->ops[i].seq, b->ops[i].l, b->ops[i].fresh ? RECORD_DEL : RECORD_VAL);
+        }
+        lightkv_batch_abort(b);
+        return false;
+    }
+    bool applied = batch_apply(kv, b->ops, b->nops);
+    pthread_rwlock_unlock(&kv->batchlock);
+    tier_release(kv, held);
+
+    // Partly written, slots it let go may still hold the records till the
+    // log is replayed at the next open
+    for (i=0; i < b->nops; i++) {
+        cache_invalidate(kv, b->ops[i].l.val);
+        publish_change(kv, seqno + b->ops[i].seq, b->ops[i].l, b->ops[i].rec->type);
+        if (b->ops[i].release && applied) {
+            retire_slot(kv, b->ops[i].l);
+        }
+    }
+
+    batch_free(b);
+    return applied;
+}
+
+void lightkv_batch_abort(lightkv_batch *b) {
+    size_t i;
+
+    // Slots taken by the batch were never visible and are free right away
+    for (i=0; i < b->nops; i++) {
+        if (b->ops[i].fresh) {
+            record *rec = create_record(RECORD_DEL, NULL, NULL, 0, get_slotsize(b->ops[i].l.l.sclass), 0);
+            write_record(b->store, b->ops[i].l, rec);
+            free(rec);
+            freelist_push(b->store, b->ops[i].l);
+        }
+    }
+
+    batch_free(b);
+}
+
+lightkv_iter *lightkv_iterator(lightkv *kv) {
+    lightkv_iter *iter = (lightkv_iter *) malloc(sizeof(lightkv_iter));
+    iter->store = kv;
+    iter->current = kv->start_loc;
+    iter->stop.val = 0;
+    iter->mode = LIGHTKV_SCAN_FULL;
+    iter->buf = NULL;
+    iter->buflen = 0;
+    iter->filter = NULL;
+    iter->ctx = NULL;
+    iter->prefix = NULL;
+    iter->prefixlen = 0;
+    iter->scratch = NULL;
+    iter->scratchsize = 0;
+    return iter;
+}
+
+lightkv_iter *lightkv_iterator_filtered(lightkv *kv, lightkv_filter filter, void *ctx) {
+    lightkv_iter *iter = lightkv_iterator(kv);
+    iter->filter = filter;
+    iter->ctx = ctx;
+    return iter;
+}
+
+lightkv_iter *lightkv_iterator_prefix(lightkv *kv, const char *prefix, uint8_t len) {
+    lightkv_iter *iter = lightkv_iterator(kv);
+    iter->prefix = (char *) calloc(len + 16, 1);
+    memcpy(iter->prefix, prefix, len);
+    iter->prefixlen = len;
+    return iter;
+}
+
+static bool iter_match(lightkv_iter *iter, const record *rec, uint32_t readable) {
+    const char *key = (const char *) rec + RECORD_HEADER_SIZE;
+    if (record_expired(rec)) {
+        return false;
+    }
+    if (iter->prefixlen && !prefix_match(key, readable, rec->extlen, iter->prefix, iter->prefixlen)) {
+        return false;
+    }
+    if (iter->filter == NULL) {
+        return true;
+    }
+
+    const char *val = iter->mode == LIGHTKV_SCAN_FULL ? (const char *) rec + val_offset(rec) : NULL;
+    uint32_t len = rec->len - val_offset(rec);
+    if (rec->flags & RECORD_COMPRESSED) {
+        uint32_t raw = 0;
+        if (len < sizeof(raw)) {
+            return true;
+        }
+        memcpy(&raw, (const char *) rec + val_offset(rec), sizeof(raw));
+        if (val) {
+            if (raw > MAX_RECORD_SIZE) {
+                return true;
+            }
+            if (raw > iter->scratchsize) {
+                iter->scratchsize = raw;
+                iter->scratch = (char *) realloc(iter->scratch, raw);
+            }
+            if (!unpack_value(iter->store, rec, iter->scratch, raw)) {
+                return true;
+            }
+            val = iter->scratch;
+        }
+        len = raw;
+    }
+    return iter->filter(rec, key, val, len, iter->ctx);
+}
+
+void lightkv_iter_mode(lightkv_iter *iter, int mode) {
+    iter->mode = mode;
+}
+
+// Partitions are cut at known record starts, the first offset of each file
+// and the starts remembered per SPLIT_GRAIN bytes, closest to an even split
+// of the bytes in use.
+lightkv_iter **lightkv_iterator_partitions(lightkv *kv, int n) {
+    int i, f, k;
+
+    if (!kv->has_scanned) {
+        lightkv_recover(kv, n);
+    }
+
+    loc end;
+    end.val = __atomic_load_n(&kv->end_loc.val, __ATOMIC_ACQUIRE);
+    uint16_t nfiles = end.l.num + 1;
+    uint64_t total = (uint64_t) end.l.num * MAX_FILESIZE + end.l.offset;
+
+    lightkv_iter **iters = (lightkv_iter **) malloc(n * sizeof(lightkv_iter *));
+    for (i=0; i < n; i++) {
+        iters[i] = lightkv_iterator(kv);
+    }
+
+    // Walk the candidate cuts in order, handing each boundary the first one
+    // at or past its share
+    i = 1;
+    for (f=0; f < nfiles && i < n; f++) {
+        for (k=0; k < SPLITS_PER_FILE && i < n; k++) {
+            uint32_t offset = k == 0 ? 1 : __atomic_load_n(&kv->splits[f][k], __ATOMIC_RELAXED);
+            uint64_t pos = (uint64_t) f * MAX_FILESIZE + offset;
+            if (offset == 0 || pos > total) {
+                continue;
+            }
+
+            loc cut;
+            cut.val = 0;
+            cut.l.num = f;
+            cut.l.offset = offset;
+            if (pos <= (uint64_t) iters[i - 1]->current.l.num * MAX_FILESIZE + iters[i - 1]->current.l.offset) {
+                continue;
+            }
+            while (i < n && pos >= total * i / n) {
+                iters[i - 1]->stop = cut;
+                iters[i]->current = cut;
+                i++;
+            }
+        }
+    }
+
+    // Not enough cuts, the remaining partitions are empty
+    for (; i < n; i++) {
+        iters[i]->current.l.num = end.l.num;
+        iters[i]->current.l.offset = MAX_FILESIZE;
+        iters[i]->stop = iters[i]->current;
+    }
+
+    return iters;
+}
+
+static bool iter_settle(lightkv_iter *iter) {
+    if ((uint64_t) iter->current.l.offset + RECORD_HEADER_SIZE >= MAX_FILESIZE) {
+        if (iter->current.l.num + 1 < __atomic_load_n(&iter->store->nfiles, __ATOMIC_ACQUIRE)) {
+            iter->current.l.num++;
+            iter->current.l.offset = 1;
+        } else {
+            return false;
+        }
+    }
+    if (iter->stop.val && (iter->current.l.num > iter->stop.l.num ||
+                (iter->current.l.num == iter->stop.l.num && iter->current.l.offset >= iter->stop.l.offset))) {
+        return false;
+    }
+    return true;
+}
+
+// In fd mode a window of SCAN_READSIZE bytes is read at the cursor when
+// the bytes are not in the last one, and the kernel is asked to read the
+// window after it meanwhile, so refills find it in the page cache. Past the
+// end of a file reads as zeros.
+static const char *iter_window(lightkv_iter *iter, uint32_t len) {
+    lightkv *kv = iter->store;
+    loc c = iter->current;
+
+#ifdef USE_MMAP
+    if ((uint64_t) c.l.offset + len > MAX_FILESIZE) {
+        return NULL;
+    }
+    mem_touch(kv, c.l.num, c.l.offset);
+    return (char *) kv->filemaps[c.l.num] + c.l.offset;
+#else
+    if (iter->buflen && iter->bufnum == c.l.num && c.l.offset >= iter->bufoff &&
+            (uint64_t) c.l.offset + len <= (uint64_t) iter->bufoff + iter->buflen) {
+        return iter->buf + (c.l.offset - iter->bufoff);
+    }
+
+    uint64_t want = SCAN_READSIZE;
+    if (c.l.offset + want > MAX_FILESIZE) {
+        want = MAX_FILESIZE - c.l.offset;
+    }
+    if (iter->stop.val && iter->stop.l.num == c.l.num && iter->stop.l.offset - c.l.offset < want) {
+        want = iter->stop.l.offset - c.l.offset;
+    }
+    if (len > want) {
+        return NULL;
+    }
+    if (iter->buf == NULL) {
+        iter->buf = (char *) malloc(SCAN_READSIZE);
+    }
+
+    arena_read_barrier(kv, c, want);
+    size_t n = read_direct(kv, c.l.num, c.l.offset, iter->buf, want);
+    memset(iter->buf + n, 0, want - n);
+    iter->bufnum = c.l.num;
+    iter->bufoff = c.l.offset;
+    iter->buflen = want;
+    if (n == want) {
+        posix_fadvise(kv->fds[c.l.num], c.l.offset + want, SCAN_READSIZE, POSIX_FADV_WILLNEED);
+    }
+    return iter->buf;
+#endif
+}
+
+static uint64_t iter_zeros(lightkv_iter *iter, const char *p, uint64_t len) {
+    loc c = iter->current, end;
+    uint64_t n = 0;
+
+    end.val = __atomic_load_n(&iter->store->end_loc.val, __ATOMIC_ACQUIRE);
+    if (!iter->store->has_scanned || c.l.num > end.l.num || (c.l.num == end.l.num && c.l.offset > end.l.offset)) {
+        return 0;
+    }
+    if (c.l.num == end.l.num && (uint64_t) end.l.offset - c.l.offset + 1 < len) {
+        len = end.l.offset - c.l.offset + 1;
+    }
+    while (n + RECORD_HEADER_SIZE <= len) {
+        uint64_t w[2];
+        memcpy(w, p + n, RECORD_HEADER_SIZE);
+        if (w[0] || w[1]) {
+            break;
+        }
+        n += RECORD_HEADER_SIZE;
+    }
+    return n;
+}
+
+// Full scans parse records in place from iter_window. Without values one
+// read of SCAN_PEEK bytes covers the header, key and raw length of a record.
+bool lightkv_next(lightkv_iter *iter, uint64_t *recid, char **key, char **val, uint32_t *len) {
+    record *rec = NULL;
+    bool rv, cont = true, owned = false;
+    char peek[SCAN_PEEK];
+
+    while (cont) {
+        cont = false;
+        if (!iter_settle(iter)) {
+            return false;
+        }
+
+        lightkv_read_begin(iter->store);
+        record rh;
+        uint64_t zeros = 0;
+        if (iter->mode == LIGHTKV_SCAN_FULL) {
+            memcpy(&rh, iter_window(iter, RECORD_HEADER_SIZE), sizeof(rh));
+            if (rh.type == RECORD_NULL) {
+                // Writes may have reached the tail since the window was read
+                iter->buflen = 0;
+                const char *p = iter_window(iter, RECORD_HEADER_SIZE);
+                memcpy(&rh, p, sizeof(rh));
+#ifdef USE_MMAP
+                zeros = iter_zeros(iter, p, MAX_FILESIZE - iter->current.l.offset);
+#else
+                zeros = iter_zeros(iter, p, iter->bufoff + iter->buflen - iter->current.l.offset);
+#endif
+            }
+        } else {
+#ifndef USE_MMAP
+            arena_read_barrier(iter->store, iter->current, SCAN_PEEK);
+#endif
+            size_t n = read_direct(iter->store, iter->current.l.num, iter->current.l.offset, peek, SCAN_PEEK);
+            memset(peek + n, 0, SCAN_PEEK - n);
+            memcpy(&rh, peek, sizeof(rh));
+            zeros = iter_zeros(iter, peek, SCAN_PEEK);
+        }
+        if (zeros) {
+            iter->current.l.offset += zeros;
+            lightkv_read_end(iter->store);
+            cont = true;
+            continue;
+        }
+        size_t rsize = roundsize(rh.len);
+        iter->current.l.sclass = get_sizeslot(rsize);
+
+        if (rh.type == RECORD_NULL) {
+            iter->store->has_scanned = true;
+            rv = false;
+        } else if (rh.len < RECORD_HEADER_SIZE || rh.len > MAX_RECORD_SIZE || rh.type > RECODE_END) {
+            // Damaged header, its length cannot lead to the next record
+            debug_log("Operation:Next, bad header at target:"LOCSTR, LOCPARAMS(iter->current));
+            iter->store->error = LIGHTKV_ERR_CHECKSUM;
+            lightkv_read_end(iter->store);
+            return false;
+        } else if (rh.type == RECODE_END) {
+            cont = true;
+        } else if (rh.type == RECORD_VAL && iter->mode == LIGHTKV_SCAN_FULL) {
+            // Larger than a window, read on its own
+            rec = (record *) iter_window(iter, rh.len);
+            owned = rec == NULL;
+            if (owned) {
+                read_record(iter->store, iter->current, &rec);
+            }
+        }
+
+        if (rh.type == RECORD_VAL && !iter_match(iter, iter->mode == LIGHTKV_SCAN_FULL ? rec : (record *) peek,
+                    iter->mode == LIGHTKV_SCAN_FULL ? rh.len - RECORD_HEADER_SIZE : SCAN_PEEK - RECORD_HEADER_SIZE)) {
+            cont = true;
+        } else if (rh.type == RECORD_VAL && iter->mode != LIGHTKV_SCAN_FULL) {
+            uint32_t raw = rh.len - val_offset(&rh);
+            if ((rh.flags & RECORD_COMPRESSED) && raw >= sizeof(raw)) {
+                memcpy(&raw, peek + val_offset(&rh), sizeof(raw));
+            }
+            *key = NULL;
+            if (iter->mode == LIGHTKV_SCAN_KEYS) {
+                *key = get_key((record *) peek);
+            }
+            *val = NULL;
+            *len = raw;
+            rv = true;
+        } else if (rh.type == RECORD_VAL && should_verify(iter->store, LIGHTKV_VERIFY_SCAN) && !verify_record(rec)) {
+            // Skip a damaged record
+            debug_log("Operation:Next, checksum mismatch at target:"LOCSTR, LOCPARAMS(iter->current));
+            iter->store->error = LIGHTKV_ERR_CHECKSUM;
+            cont = true;
+        } else if (rh.type == RECORD_VAL) {
+            *key = get_key(rec);
+            *len = record_value(iter->store, rec, val);
+            rv = true;
+            if (*val == NULL) {
+                debug_log("Operation:Next, bad compressed value at target:"LOCSTR, LOCPARAMS(iter->current));
+                iter->store->error = LIGHTKV_ERR_CHECKSUM;
+                free(*key);
+                cont = true;
+            }
+
+        } else if (rh.type == RECORD_DEL) {
+            if (iter->store->has_scanned == false) {
+                freelist_push(iter->store, iter->current);
+            }
+            cont = true;
+        }
+        lightkv_read_end(iter->store);
+        if (owned) {
+            free(rec);
+            owned = false;
+        }
+
+        if (iter->store->has_scanned == false) {
+            loc end = iter->current;
+            end.l.offset += rsize - 1;
+            __atomic_store_n(&iter->store->end_loc.val, end.val, __ATOMIC_RELEASE);
+        }
+
+        *recid = iter->current.val;
+
+        iter->current.l.offset += rsize;
+
+        if (cont) continue;
+
+        return rv;
+    }
+
+    return false;
+}
+
+lightkv_scanbuf *lightkv_scanbuf_new(size_t size, int cap) {
+    lightkv_scanbuf *sb = (lightkv_scanbuf *) malloc(sizeof(lightkv_scanbuf));
+#ifdef USE_MMAP
+    sb->buf = NULL;
+#else
+    sb->buf = (char *) malloc(size);
+#endif
+    sb->size = size;
+    sb->vals = NULL;
+    sb->valsize = 0;
+    sb->entries = (lightkv_entry *) malloc(cap * sizeof(lightkv_entry));
+    sb->cap = cap;
+    return sb;
+}
+
+void lightkv_scanbuf_free(lightkv_scanbuf *sb) {
+    free(sb->buf);
+    free(sb->vals);
+    free(sb->entries);
+    free(sb);
+}
+
+// Records are parsed in place, from reads at the cursor appended to sb->buf
+// in fd mode, or from the mapping. Only compressed values are copied, into
+// sb->vals. A call stops early rather than reuse space its entries point
+// to; the buffers only grow when a single record does not fit in them.
+// Without values, large records are peeked at a SCAN_PEEK read each
+// instead of read whole.
+int lightkv_next_batch(lightkv_iter *iter, lightkv_scanbuf *sb, int max) {
+    lightkv *kv = iter->store;
+    bool sparse = iter->mode != LIGHTKV_SCAN_FULL;
+    size_t vused = 0;
+#ifndef USE_MMAP
+    size_t bufused = 0;
+#endif
+    uint64_t slot = sparse ? SCAN_PEEK : 0; // Slot size of the last record
+    bool more = true;
+    int n = 0;
+
+    if (max > sb->cap) {
+        max = sb->cap;
+    }
+
+    lightkv_read_begin(kv);
+    while (more && n < max && iter_settle(iter)) {
+        loc at = iter->current;
+        const char *base;
+        uint64_t avail;
+        bool eof;
+#ifdef USE_MMAP
+        base = (char *) kv->filemaps[at.l.num] + at.l.offset;
+        avail = MAX_FILESIZE - at.l.offset;
+        eof = true;
+#else
+        if (n == 0) {
+            bufused = 0;
+        }
+        uint64_t want = sb->size - bufused;
+        if (sparse && slot >= SCAN_PEEK && want > SCAN_PEEK) {
+            want = SCAN_PEEK;
+        }
+        if (iter->stop.val && iter->stop.l.num == at.l.num && iter->stop.l.offset - at.l.offset < want) {
+            want = iter->stop.l.offset - at.l.offset;
+        }
+        base = sb->buf + bufused;
+        arena_read_barrier(kv, at, want);
+        avail = read_direct(kv, at.l.num, at.l.offset, sb->buf + bufused, want);
+        eof = avail < want;
+        bufused += avail;
+        if (!sparse && !eof) {
+            posix_fadvise(kv->fds[at.l.num], at.l.offset + avail, want, POSIX_FADV_WILLNEED);
+        }
+#endif
+
+        while (n < max) {
+            if (!iter_settle(iter)) {
+                more = false;
+                break;
+            }
+            if (iter->current.l.num != at.l.num) {
+                break;
+            }
+
+            uint64_t pos = iter->current.l.offset - at.l.offset;
+            if (pos + RECORD_HEADER_SIZE > avail) {
+                // Past the end of file reads as unallocated space
+                if (eof) {
+                    kv->has_scanned = true;
+                    more = false;
+                }
+                break;
+            }
+
+            const char *p = base + pos;
+            record rh;
+            memcpy(&rh, p, RECORD_HEADER_SIZE);
+            slot = roundsize(rh.len);
+            iter->current.l.sclass = get_sizeslot(slot);
+
+            if (rh.type == RECORD_NULL) {
+                uint64_t zeros = iter_zeros(iter, p, avail - pos);
+                if (zeros) {
+                    iter->current.l.offset += zeros;
+                    continue;
+                }
+                kv->has_scanned = true;
+                more = false;
+                break;
+            }
+
+            // Bytes of the record needed
+            uint64_t need = RECORD_HEADER_SIZE;
+            if (rh.type == RECORD_VAL) {
+                need = !sparse ? rh.len :
+                    val_offset(&rh) + (rh.flags & RECORD_COMPRESSED ? sizeof(uint32_t) : 0);
+            }
+            if (rh.len < RECORD_HEADER_SIZE || rh.len > MAX_RECORD_SIZE || rh.type > RECODE_END ||
+                    need > rh.len || (pos + need > avail && eof)) {
+                // Damaged header, its length cannot lead to the next record
+                debug_log("Operation:Next, bad header at target:"LOCSTR, LOCPARAMS(iter->current));
+                kv->error = LIGHTKV_ERR_CHECKSUM;
+                more = false;
+                break;
+            }
+            if (pos + need > avail) {
+                // Read again from the record, larger than the buffer if need be
+                if (pos == 0 && n == 0) {
+                    sb->size = roundsize(need);
+                    sb->buf = (char *) realloc(sb->buf, sb->size);
+                }
+                break;
+            }
+
+            if (rh.type == RECORD_VAL && iter_match(iter, (const record *) p, avail - pos - RECORD_HEADER_SIZE)) {
+                const record *rec = (const record *) p;
+                lightkv_entry *e = &sb->entries[n];
+                uint32_t raw = 0;
+                bool ok = sparse || !should_verify(kv, LIGHTKV_VERIFY_SCAN) || verify_record(rec);
+
+                e->recid = iter->current.val;
+                e->keylen = rh.extlen;
+                e->key = iter->mode != LIGHTKV_SCAN_HEADERS ? p + RECORD_HEADER_SIZE : NULL;
+                e->val = sparse ? NULL : p + val_offset(&rh);
+                e->len = rh.len - val_offset(&rh);
+                if (ok && (rh.flags & RECORD_COMPRESSED)) {
+                    if (e->len >= sizeof(raw)) {
+                        memcpy(&raw, p + val_offset(&rh), sizeof(raw));
+                    }
+                    ok = e->len >= sizeof(raw) && raw <= MAX_RECORD_SIZE;
+                    e->len = raw;
+                }
+                if (ok && !sparse && (rh.flags & RECORD_COMPRESSED)) {
+                    if (vused + raw > sb->valsize) {
+                        if (n) {
+                            more = false;
+                            break;
+                        }
+                        sb->valsize = raw > sb->size ? raw : sb->size;
+                        sb->vals = (char *) realloc(sb->vals, sb->valsize);
+                    }
+                    ok = unpack_value(kv, rec, sb->vals + vused, raw);
+                    e->val = sb->vals + vused;
+                    vused += raw;
+                }
+
+                if (ok) {
+                    n++;
+#ifdef USE_MMAP
+                    mem_touch(kv, at.l.num, iter->current.l.offset);
+#endif
+                } else {
+                    // Skip a damaged record
+                    debug_log("Operation:Next, damaged record at target:"LOCSTR, LOCPARAMS(iter->current));
+                    kv->error = LIGHTKV_ERR_CHECKSUM;
+                }
+            } else if (rh.type == RECORD_DEL && kv->has_scanned == false) {
+                freelist_push(kv, iter->current);
+            }
+
+            if (kv->has_scanned == false) {
+                loc end = iter->current;
+                end.l.offset += slot - 1;
+                __atomic_store_n(&kv->end_loc.val, end.val, __ATOMIC_RELEASE);
+            }
+            iter->current.l.offset += slot;
+        }
+
+#ifndef USE_MMAP
+        // Out of room for another read without overwriting what the
+        // entries point to
+        if (n && iter->current.l.num == at.l.num && iter->current.l.offset == at.l.offset) {
+            break;
+        }
+#endif
+    }
+    lightkv_read_end(kv);
+
+    return n;
+}
+
+void lightkv_free_iter(lightkv_iter *iter) {
+    free(iter->buf);
+    free(iter->prefix);
+    free(iter->scratch);
+    free(iter);
+}
+
+void lightkv_free_partitions(lightkv_iter **iters, int n) {
+    int i;
+    for (i=0; i < n; i++) {
+        lightkv_free_iter(iters[i]);
+    }
+    free(iters);
+}
+
+static void sync_files(lightkv *kv) {
+    int i, nfiles, oldwal = -1;
+    arena *a;
+
+    pthread_mutex_lock(&kv->ckptlock);
+    if (kv->walfd >= 0) {
+        // Batches logged in the old log are applied before it can go
+        pthread_rwlock_wrlock(&kv->batchlock);
+        oldwal = wal_switch(kv);
+        pthread_rwlock_unlock(&kv->batchlock);
+    }
+    loc end;
+    end.val = __atomic_load_n(&kv->end_loc.val, __ATOMIC_ACQUIRE);
+
+    for (a = __atomic_load_n(&kv->arenas, __ATOMIC_ACQUIRE); a; a = a->next) {
+        pthread_mutex_lock(&a->lock);
+        arena_flush(kv, a);
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    nfiles = __atomic_load_n(&kv->nfiles, __ATOMIC_ACQUIRE);
+    for (i=0; i < nfiles; i++) {
+        sync_dirty(kv, i);
+    }
+
+    // Records upto end are on disk now
+    write_super(kv, end, false);
+
+    if (oldwal >= 0) {
+        char *f = getwalpath(kv->basepath, oldwal);
+        unlink(f);
+        free(f);
+    }
+    pthread_mutex_unlock(&kv->ckptlock);
+}
 
-    debug_log("Operation:Insert, completed at target:"LOCSTR, LOCPARAMS(diskloc));
-    return diskloc.val;
+void lightkv_sync(lightkv *kv) {
+    sync_files(kv);
 }
 
-bool lightkv_get(lightkv *kv, uint64_t recid, char **key, char **val, uint32_t *len) {
-    bool rv;
-    record *rec;
-    loc l;
-    l.val = recid;
-    debug_log("Operation:Get, target:"LOCSTR, LOCPARAMS(l));
+// Write ahead log
+//
+// The log is a redo log: a write is logged after it reaches the data file,
+// or its arena buffer, as an image of the bytes written at a recid. Single
+// writes only go to free slots or put a tombstone over a record while it is
+// on, updates move instead of overwriting, so a torn data write never loses
+// a committed value; batches log before they write. Replaying a log is
+// idempotent and only needs the entries in lsn order. A sync of the data
+// files starts a new log generation first and drops the old one once the
+// sync is done, as all writes logged there have reached the data files by
+// then.
 
-    read_record(kv, l, &rec);
-    rv = rec->type == RECORD_VAL ? true: false;
-    if (rv == false) {
-        free(rec);
+static uint32_t wal_checksum(const walentry *e, const char *buf) {
+    return crc32c(crc32c(0, e, offsetof(walentry, check)), buf, e->len);
+}
+
+// Entries after a failed write are not replayed past the torn one, so the
+// log is given up on till a checkpoint starts the next
+static void wal_fail(lightkv *kv) {
+    debug_log("Operation:Log, write to generation %d failed: %s", kv->walgen, strerror(errno));
+    __atomic_store_n(&kv->walfailed, true, __ATOMIC_RELEASE);
+    kv->wallen = 0;
+    kv->error = LIGHTKV_ERR_WAL;
+}
+
+// Hand buffered entries to the OS, wallock held
+static bool wal_write(lightkv *kv) {
+    uint32_t done = 0;
+
+    if (kv->walfailed) {
         return false;
     }
+    while (done < kv->wallen) {
+        ssize_t n = write(kv->walfd, kv->walbuf + done, kv->wallen - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            wal_fail(kv);
+            return false;
+        }
+        done += n;
+    }
+    kv->wallen = 0;
+    __atomic_store_n(&kv->walwritten, kv->wallsn, __ATOMIC_RELEASE);
+    return true;
+}
 
-    *key = get_key(rec);
-    *len = get_val(rec, val);
-    free(rec);
+// Add an entry for len bytes of buf at recid, wallock held
+static uint64_t wal_put(lightkv *kv, uint64_t recid, const char *buf, uint32_t len, uint32_t rest) {
+    walentry e;
 
-    debug_log("Operation:Get, fetched %s of vallen:%d", *key, *len);
-    return true;
+    if (kv->walfailed) {
+        return WAL_FAILED;
+    }
+    e.lsn = ++kv->wallsn;
+    e.recid = recid;
+    e.len = len;
+    e.rest = rest;
+    e.check = wal_checksum(&e, buf);
+
+    if (kv->wallen + sizeof(e) + len > WAL_BUFSIZE && !wal_write(kv)) {
+        return WAL_FAILED;
+    }
+    if (sizeof(e) + len > WAL_BUFSIZE) {
+        // Too big to buffer, goes out right away
+        memcpy(kv->walbuf, &e, sizeof(e));
+        kv->wallen = sizeof(e);
+        if (!wal_write(kv)) {
+            return WAL_FAILED;
+        }
+        if (!write_all(kv->walfd, buf, len)) {
+            wal_fail(kv);
+            return WAL_FAILED;
+        }
+    } else {
+        memcpy(kv->walbuf + kv->wallen, &e, sizeof(e));
+        memcpy(kv->walbuf + kv->wallen + sizeof(e), buf, len);
+        kv->wallen += sizeof(e) + len;
+    }
+
+    return e.lsn;
 }
 
-bool lightkv_delete(lightkv *kv, uint64_t recid) {
-    // TODO: basic sanity
-    loc l;
-    l.val = recid;
-    debug_log("Operation:Delete, target:"LOCSTR, LOCPARAMS(l));
+static uint64_t wal_append(lightkv *kv, loc l, const char *buf, uint32_t len) {
+    if (__atomic_load_n(&kv->walfd, __ATOMIC_ACQUIRE) < 0) {
+        return 0;
+    }
 
-    size_t slotsize = get_slotsize(l.l.sclass);
-    record *rec = create_record(RECORD_DEL, NULL, NULL, 0, slotsize);
-    write_record(kv, l, rec);
-    freeloc *f = freeloc_new(l);
-    kv->freelist[l.l.sclass] = freelist_add(kv->freelist[l.l.sclass], f);
-    free(rec);
-    return true;
+    pthread_mutex_lock(&kv->wallock);
+    uint64_t lsn = wal_put(kv, l.val, buf, len, 0);
+    pthread_mutex_unlock(&kv->wallock);
+
+    return lsn;
 }
 
-uint64_t lightkv_update(lightkv *kv, uint64_t recid, const char *key, const char *val, uint32_t len) {
-    loc l;
-    l.val = recid;
-    debug_log("Operation:Update, target:"LOCSTR" key:%s vallen:%d", LOCPARAMS(l), key, len);
+static uint64_t wal_append_batch(lightkv *kv, batchop *ops, size_t n) {
+    uint64_t lsn = 0;
+    size_t i;
 
-    size_t slotsize = get_slotsize(l.l.sclass);
-    record *rec = create_record(RECORD_VAL, key, val, len, 0);
+    // Entries of a batch are adjacent in the log, each counting the rest
+    pthread_mutex_lock(&kv->wallock);
+    for (i=0; i < n && lsn != WAL_FAILED; i++) {
+        lsn = wal_put(kv, ops[i].l.val, (char *) ops[i].rec, ops[i].len, n - 1 - i);
+    }
+    pthread_mutex_unlock(&kv->wallock);
+
+    return lsn;
+}
 
-    // We need to find a new slot
-    if (rec->len > slotsize) {
-        lightkv_delete(kv, recid);
-        int rsize = roundsize(rec->len);
-        l = find_freeloc(kv, rsize);
+static bool wal_commit(lightkv *kv, uint64_t lsn) {
+    arena *a = arena_get(kv);
+    return wal_flush(kv, lsn, a->durability == LIGHTKV_DURABLE_DEFAULT ? kv->durability : a->durability);
+}
+
+static bool wal_flush(lightkv *kv, uint64_t lsn, int level) {
+    bool ok = true;
+
+    if (lsn == WAL_FAILED) {
+        return false;
+    }
+    if (lsn == 0 || level == LIGHTKV_DURABLE_NONE) {
+        return true;
     }
 
-    write_record(kv, l, rec);
-    free(rec);
+    if (__atomic_load_n(&kv->walwritten, __ATOMIC_ACQUIRE) < lsn) {
+        pthread_mutex_lock(&kv->wallock);
+        if (kv->walwritten < lsn) {
+            ok = wal_write(kv);
+        }
+        pthread_mutex_unlock(&kv->wallock);
+    }
 
-    debug_log("Operation:Update, completed at target:"LOCSTR, LOCPARAMS(l));
-    return l.val;
+    // Whoever syncs covers every entry written so far, threads queued
+    // behind usually find their lsn synced already
+    if (ok && level == LIGHTKV_DURABLE_SYNC && __atomic_load_n(&kv->walsynced, __ATOMIC_ACQUIRE) < lsn) {
+        pthread_mutex_lock(&kv->walsynclock);
+        if (kv->walsynced < lsn) {
+            uint64_t target = __atomic_load_n(&kv->walwritten, __ATOMIC_ACQUIRE);
+            if (fdatasync(kv->walfd) == 0) {
+                __atomic_store_n(&kv->walsynced, target, __ATOMIC_RELEASE);
+            } else {
+                pthread_mutex_lock(&kv->wallock);
+                wal_fail(kv);
+                pthread_mutex_unlock(&kv->wallock);
+                ok = false;
+            }
+        }
+        pthread_mutex_unlock(&kv->walsynclock);
+    }
+    return ok;
 }
 
-lightkv_iter *lightkv_iterator(lightkv *kv) {
-    lightkv_iter *iter = (lightkv_iter *) malloc(sizeof(lightkv_iter));
-    iter->store = kv;
-    iter->current = kv->start_loc;
-    return iter;
+static int wal_switch(lightkv *kv) {
+    int old = -1;
+
+    pthread_mutex_lock(&kv->walsynclock);
+    pthread_mutex_lock(&kv->wallock);
+    if (kv->wallsn >= kv->walstart) {
+        // Old log stays durable till the data files are
+        wal_write(kv);
+        fdatasync(kv->walfd);
+        __atomic_store_n(&kv->walsynced, kv->wallsn, __ATOMIC_RELEASE);
+        close(kv->walfd);
+
+        old = kv->walgen++;
+        char *f = getwalpath(kv->basepath, kv->walgen);
+        __atomic_store_n(&kv->walfd, open(f, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644), __ATOMIC_RELAXED);
+        assert(kv->walfd >= 0);
+        free(f);
+        kv->walstart = kv->wallsn + 1;
+        // Whatever the old log missed reaches the data files with this sync
+        __atomic_store_n(&kv->walfailed, false, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&kv->wallock);
+    pthread_mutex_unlock(&kv->walsynclock);
+
+    return old;
 }
 
-bool lightkv_next(lightkv_iter *iter, uint64_t *recid, char **key, char **val, uint32_t *len) {
-    record *rec;
-    bool rv, cont = true;
+static int wal_replay(lightkv *kv, int gen, uint64_t *lastlsn) {
+    char *f = getwalpath(kv->basepath, gen);
+    int fd = open(f, O_RDONLY);
+    int n = 0;
+    free(f);
+    if (fd < 0) {
+        return 0;
+    }
 
-    while (cont) {
-        cont = false;
-        if ((uint64_t) iter->current.l.offset + RECORD_HEADER_SIZE >= MAX_FILESIZE) {
-            if (iter->current.l.num + 1 < iter->store->nfiles) {
-                iter->current.l.num++;
-                iter->current.l.offset = 1;
-            } else {
+    char *buf = (char *) malloc(MAX_RECORD_SIZE);
+    uint64_t offset = 0;
+    walentry e;
+    while (pread(fd, &e, sizeof(e), offset) == sizeof(e)) {
+        // A torn or stale entry ends the log
+        if (e.lsn <= *lastlsn || e.len > MAX_RECORD_SIZE ||
+                pread(fd, buf, e.len, offset + sizeof(e)) != e.len ||
+                wal_checksum(&e, buf) != e.check) {
+            break;
+        }
+        // A batch is applied only if all of it made it to the log
+        if (e.rest && !wal_batch_complete(fd, offset, &e)) {
+            debug_log("Operation:WalReplay, dropping torn batch at lsn %"PRIu64, e.lsn);
+            break;
+        }
+
+        loc l;
+        l.val = e.recid;
+        if (l.l.num >= MAX_NFILES) {
+            break;
+        }
+        while (l.l.num >= kv->nfiles) {
+            open_datafile(kv, kv->nfiles);
+        }
+        if (write_direct(kv, l, buf, e.len) < 0) {
+            n = -1;
+            break;
+        }
+        extend_end(kv, l, get_slotsize(l.l.sclass));
+        if (e.len >= RECORD_HEADER_SIZE && ((record *) buf)->seqno) {
+            note_seqno(kv, ((record *) buf)->seqno);
+        }
+        if (e.len >= RECORD_HEADER_SIZE && ((record *) buf)->type == RECORD_VAL &&
+                e.len >= val_offset((record *) buf) && (((record *) buf)->flags & RECORD_EXPIRES)) {
+            expire_add(kv, l, record_expiry((record *) buf));
+        }
+
+        *lastlsn = e.lsn;
+        offset += sizeof(e) + e.len;
+        n++;
+    }
+
+    free(buf);
+    close(fd);
+    debug_log("Operation:WalReplay, %d entries of log %d upto lsn %"PRIu64, n, gen, *lastlsn);
+    return n;
+}
+
+static bool wal_batch_complete(int fd, uint64_t offset, const walentry *e) {
+    walentry prev = *e, next;
+    char buf[65536];
+
+    offset += sizeof(prev) + prev.len;
+    while (prev.rest) {
+        if (pread(fd, &next, sizeof(next), offset) != sizeof(next) ||
+                next.lsn != prev.lsn + 1 || next.rest != prev.rest - 1 ||
+                next.len > MAX_RECORD_SIZE) {
+            return false;
+        }
+
+        // Checksum the image piecewise, it is read again when applied
+        uint32_t crc = crc32c(0, &next, offsetof(walentry, check)), done = 0;
+        while (done < next.len) {
+            uint32_t n = next.len - done < sizeof(buf) ? next.len - done : sizeof(buf);
+            if (pread(fd, buf, n, offset + sizeof(next) + done) != n) {
                 return false;
             }
+            crc = crc32c(crc, buf, n);
+            done += n;
+        }
+        if (crc != next.check) {
+            return false;
         }
 
-        record rh = read_recheader(iter->store, iter->current);
-        size_t rsize = roundsize(rh.len);
-        iter->current.l.sclass = get_sizeslot(rsize);
+        offset += sizeof(next) + next.len;
+        prev = next;
+    }
 
-        if (rh.type == RECORD_NULL) {
-            iter->store->has_scanned = true;
-            rv = false;
-        } else if (rh.type == RECODE_END) {
-            cont = true;
-        } else if (rh.type == RECORD_VAL) {
-            read_record(iter->store, iter->current, &rec);
-            *key = get_key(rec);
-            *len = get_val(rec, val);
-            free(rec);
-            rv = true;
+    return true;
+}
 
-        } else if (rh.type == RECORD_DEL) {
-            if (iter->store->has_scanned == false) {
-                freeloc *f = freeloc_new(iter->current);
-                iter->store->freelist[iter->current.l.sclass] = freelist_add(iter->store->freelist[iter->current.l.sclass], f);
+static int wal_recover(lightkv *kv) {
+    int gens[MAX_NFILES * 4], ngens = 0, i, j, n = 0;
+    uint64_t lastlsn = 0;
+
+    // Logs of an earlier run, oldest first
+    DIR *dir = opendir(kv->basepath);
+    if (dir) {
+        struct dirent *d;
+        int gen;
+        while ((d = readdir(dir)) && ngens < MAX_NFILES * 4) {
+            if (sscanf(d->d_name, WALFILE_FORMATSTR, &gen) == 1) {
+                gens[ngens++] = gen;
             }
-            cont = true;
         }
+        closedir(dir);
+    }
+    for (i=1; i < ngens; i++) {
+        for (j=i; j > 0 && gens[j - 1] > gens[j]; j--) {
+            int t = gens[j];
+            gens[j] = gens[j - 1];
+            gens[j - 1] = t;
+        }
+    }
 
-        if (iter->store->has_scanned == false) {
-            iter->store->end_loc = iter->current;
-            iter->store->end_loc.l.offset += rsize - 1;
+    // Logs without data files are stale
+    for (i=0; i < ngens && !kv->has_scanned; i++) {
+        int r = wal_replay(kv, gens[i], &lastlsn);
+        if (r < 0) {
+            // Kept for the next open to replay again
+            debug_log("Operation:WalReplay, generation %d could not be applied", gens[i]);
+            return -1;
+        }
+        n += r;
+    }
+    if (n) {
+        for (i=0; i < kv->nfiles; i++) {
+            sync_dirty(kv, i);
+        }
+    }
+    for (i=0; i < ngens; i++) {
+        char *f = getwalpath(kv->basepath, gens[i]);
+        unlink(f);
+        free(f);
+    }
+
+    kv->walgen = ngens ? gens[ngens - 1] + 1 : 0;
+    kv->wallsn = lastlsn;
+    kv->walreplayed = n;
+    return n;
+}
+
+int lightkv_set_wal(lightkv *kv, int durability) {
+    kv->durability = durability;
+    if (kv->walfd >= 0) {
+        return kv->walreplayed;
+    }
+
+    kv->walstart = kv->wallsn + 1;
+    kv->walwritten = kv->wallsn;
+    kv->walsynced = kv->wallsn;
+    kv->wallen = 0;
+    kv->walbuf = (char *) malloc(WAL_BUFSIZE);
+
+    char *f = getwalpath(kv->basepath, kv->walgen);
+    int fd = open(f, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    free(f);
+    if (fd < 0) {
+        free(kv->walbuf);
+        kv->walbuf = NULL;
+        return -1;
+    }
+    __atomic_store_n(&kv->walfd, fd, __ATOMIC_RELEASE);
+
+    return kv->walreplayed;
+}
+
+void lightkv_set_durability(lightkv *kv, int level) {
+    kv->durability = level;
+}
+
+void lightkv_set_thread_durability(lightkv *kv, int level) {
+    arena_get(kv)->durability = level;
+}
+
+static void extend_end(lightkv *kv, loc l, uint32_t size) {
+    loc end = l;
+    end.l.sclass = 0;
+    end.l.offset += size - 1;
+
+    if (end.l.num > kv->end_loc.l.num ||
+            (end.l.num == kv->end_loc.l.num && end.l.offset > kv->end_loc.l.offset)) {
+        kv->end_loc = end;
+    }
+}
+
+// Superblock
+//
+// super.db is replaced by writing a temporary file and renaming it. It
+// records the end of db a checkpoint synced and the free slots of the
+// global freelists. After a clean close the next open needs no scan at all.
+// Opening marks the superblock unclean again since free slots change from
+// then on; after a crash the recorded slots are only kept if their header
+// still says DEL and the records past the checkpoint are scanned.
+
+static bool write_all(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = write(fd, (const char *) buf + done, len - done);
+        if (n <= 0) {
+            return false;
         }
+        done += n;
+    }
+    return true;
+}
 
-        *recid = iter->current.val;
+static int write_super(lightkv *kv, loc end, bool clean) {
+    superblock sb;
+    uint64_t nfree = 0, i = 0;
+    uint64_t *recids, *expiries;
+    freeloc *f;
+    expent *e;
+    int slot, rv = -1;
 
-        iter->current.l.offset += rsize;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = SUPER_MAGIC;
+    sb.version = kv->version;
+    sb.nfiles = __atomic_load_n(&kv->nfiles, __ATOMIC_ACQUIRE);
+    sb.end_loc = end.val;
+    sb.seqno = __atomic_load_n(&kv->seqno, __ATOMIC_ACQUIRE);
+    sb.clean = clean;
+    sb.freeoff = sizeof(sb);
 
-        if (cont) continue;
+    recids = (uint64_t *) malloc(sizeof(uint64_t));
+    for (slot=0; slot < MAX_SIZES; slot++) {
+        pthread_mutex_lock(&kv->freelocks[slot]);
+        for (f = kv->freelist[slot]; f; f = f->next) {
+            sb.counts[slot]++;
+        }
+        nfree += sb.counts[slot];
+        recids = (uint64_t *) realloc(recids, nfree * sizeof(uint64_t) + 1);
+        for (f = kv->freelist[slot]; f; f = f->next) {
+            recids[i++] = f->l.val;
+        }
+        pthread_mutex_unlock(&kv->freelocks[slot]);
+    }
 
-        return rv;
+    pthread_mutex_lock(&kv->wheellock);
+    expiries = (uint64_t *) malloc(2 * kv->nexpiring * sizeof(uint64_t) + 1);
+    for (slot = -1; slot < WHEEL_LEVELS * WHEEL_SLOTS; slot++) {
+        for (e = slot < 0 ? kv->due : kv->wheel[slot / WHEEL_SLOTS][slot % WHEEL_SLOTS]; e; e = e->next) {
+            expiries[2 * sb.nexpire] = e->recid;
+            expiries[2 * sb.nexpire + 1] = e->expiry;
+            sb.nexpire++;
+        }
     }
+    pthread_mutex_unlock(&kv->wheellock);
 
-    return false;
+    sb.check = crc32c(crc32c(crc32c(0, &sb, offsetof(superblock, check)), recids, nfree * sizeof(uint64_t)),
+            expiries, 2 * sb.nexpire * sizeof(uint64_t));
+
+    char *tmp = joinpath(kv->basepath, SUPERFILE_TMP);
+    char *path = joinpath(kv->basepath, SUPERFILE);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        if (write_all(fd, &sb, sizeof(sb)) &&
+                write_all(fd, recids, nfree * sizeof(uint64_t)) &&
+                write_all(fd, expiries, 2 * sb.nexpire * sizeof(uint64_t)) &&
+                fdatasync(fd) == 0) {
+            rv = rename(tmp, path);
+        }
+        close(fd);
+
+        // Make the rename durable
+        int dfd = open(kv->basepath, O_RDONLY);
+        if (dfd >= 0) {
+            fsync(dfd);
+            close(dfd);
+        }
+    }
+    free(tmp);
+    free(path);
+    free(recids);
+    free(expiries);
+
+    debug_log("Operation:Super, clean:%d end at "LOCSTR" with %"PRIu64" free slots", clean, LOCPARAMS(end), nfree);
+    return rv;
 }
 
-void lightkv_free_iter(lightkv_iter *iter) {
-    free(iter);
+static int load_super(lightkv *kv) {
+    superblock sb;
+    uint64_t nfree = 0, i;
+    uint64_t *recids = NULL, *expiries = NULL;
+    size_t hdrlen = offsetof(superblock, check);
+    int slot;
+    bool ok;
+
+    char *path = joinpath(kv->basepath, SUPERFILE);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&sb, 0, sizeof(sb));
+    ssize_t n = pread(fd, &sb, sizeof(sb), 0);
+    if (sb.magic == SUPER_MAGIC_V1 && n >= (ssize_t) (offsetof(superblock, nexpire) + sizeof(sb.check))) {
+        // The checksum sits where nexpire is now and covers what precedes it
+        hdrlen = offsetof(superblock, nexpire);
+        memcpy(&sb.check, &sb.nexpire, sizeof(sb.check));
+        sb.nexpire = 0;
+    } else if (n != sizeof(sb) || sb.magic != SUPER_MAGIC) {
+        sb.magic = 0;
+    }
+
+    ok = sb.magic != 0 && sb.version == kv->version &&
+        sb.nfiles > 0 && sb.nfiles <= kv->nfiles;
+    if (ok) {
+        for (slot=0; slot < MAX_SIZES; slot++) {
+            nfree += sb.counts[slot];
+        }
+        recids = (uint64_t *) malloc(nfree * sizeof(uint64_t) + 1);
+        ok = pread(fd, recids, nfree * sizeof(uint64_t), sb.freeoff) == (ssize_t) (nfree * sizeof(uint64_t));
+    }
+    struct stat st;
+    ok = ok && fstat(fd, &st) == 0 && sb.nexpire <= (uint64_t) st.st_size / (2 * sizeof(uint64_t));
+    if (ok) {
+        size_t elen = 2 * sb.nexpire * sizeof(uint64_t);
+        expiries = (uint64_t *) malloc(elen + 1);
+        ok = pread(fd, expiries, elen, sb.freeoff + nfree * sizeof(uint64_t)) == (ssize_t) elen &&
+            crc32c(crc32c(crc32c(0, &sb, hdrlen), recids, nfree * sizeof(uint64_t)),
+                    expiries, elen) == sb.check;
+    }
+    close(fd);
+    if (!ok) {
+        free(recids);
+        free(expiries);
+        return -1;
+    }
+
+    loc end;
+    end.val = sb.end_loc;
+    kv->end_loc = end;
+    if (sb.seqno > kv->seqno) {
+        kv->seqno = sb.seqno;
+    }
+    bool clean = sb.clean && sb.nfiles == kv->nfiles && kv->walreplayed == 0;
+    for (i=0; i < nfree; i++) {
+        loc l;
+        l.val = recids[i];
+        if (!clean) {
+            record rh = read_recheader(kv, l);
+            if (rh.type != RECORD_DEL || rh.len != get_slotsize(l.l.sclass)) {
+                continue;
+            }
+        }
+        kv->freelist[l.l.sclass] = freelist_add(kv->freelist[l.l.sclass], freeloc_new(l));
+    }
+    for (i=0; i < sb.nexpire; i++) {
+        loc l;
+        l.val = expiries[2 * i];
+        expire_add(kv, l, (uint32_t) expiries[2 * i + 1]);
+    }
+    free(expiries);
+
+    if (clean) {
+        kv->has_scanned = true;
+        write_super(kv, end, false);
+    } else {
+        // Records written after the checkpoint
+        recover_from(kv, end, 1);
+    }
+    free(recids);
+
+    debug_log("Operation:Open, superblock clean:%d end at "LOCSTR, sb.clean, LOCPARAMS(kv->end_loc));
+    return sb.clean;
 }
 
-void lightkv_sync(lightkv *kv) {
-    int i;
-    for (i=0; i < kv->nfiles; i++) {
-#ifdef USE_MMAP
-        msync(kv->filemaps[i], MAX_FILESIZE, MS_SYNC);
-#else
-        fsync(kv->fds[i]);
+// Group commit
+//
+// Callers take a ticket and the flusher thread syncs on their behalf. A
+// flush covers every ticket handed out before it started, so concurrent
+// writers asking for durability share a single fsync.
+
+static void *flusher_main(void *arg) {
+    lightkv *kv = (lightkv *) arg;
+
+    pthread_mutex_lock(&kv->synclock);
+    while (1) {
+        while (kv->syncdone == kv->syncreq && !kv->flusher_stop) {
+            pthread_cond_wait(&kv->syncwork, &kv->synclock);
+        }
+        if (kv->syncdone == kv->syncreq) {
+            break;
+        }
+
+        uint64_t target = kv->syncreq;
+        pthread_mutex_unlock(&kv->synclock);
+
+        debug_log("Operation:GroupSync, tickets upto %"PRIu64, target);
+        sync_files(kv);
+
+        pthread_mutex_lock(&kv->synclock);
+        __atomic_store_n(&kv->syncdone, target, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&kv->syncdone_cond);
+    }
+    pthread_mutex_unlock(&kv->synclock);
+
+    return NULL;
+}
+
+void lightkv_sync_async(lightkv *kv, uint64_t *ticket) {
+    pthread_mutex_lock(&kv->synclock);
+    if (!kv->flusher_on) {
+        if (pthread_create(&kv->flusher, NULL, flusher_main, kv)) {
+            assert(false);
+        }
+        kv->flusher_on = true;
+    }
+    *ticket = ++kv->syncreq;
+    pthread_cond_signal(&kv->syncwork);
+    pthread_mutex_unlock(&kv->synclock);
+}
+
+void lightkv_sync_wait(lightkv *kv, uint64_t ticket) {
+    if (lightkv_is_durable(kv, ticket)) {
+        return;
+    }
+
+    pthread_mutex_lock(&kv->synclock);
+    while (kv->syncdone < ticket) {
+        pthread_cond_wait(&kv->syncdone_cond, &kv->synclock);
+    }
+    pthread_mutex_unlock(&kv->synclock);
+}
+
+bool lightkv_is_durable(lightkv *kv, uint64_t ticket) {
+    return __atomic_load_n(&kv->syncdone, __ATOMIC_ACQUIRE) >= ticket;
+}
+
+int lightkv_set_writebuffer(lightkv *kv, size_t size) {
+    arena *a;
+
+    for (a = kv->arenas; a; a = a->next) {
+        pthread_mutex_lock(&a->lock);
+        arena_retire(kv, a);
+        free(a->buf);
+        a->buf = NULL;
+        pthread_mutex_unlock(&a->lock);
+    }
+
+#ifndef USE_MMAP
+    kv->buffered = size != 0;
 #endif
+    if (size) {
+        kv->chunksize = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    } else {
+        kv->chunksize = ARENA_CHUNK;
     }
+
+    return 0;
 }
 
 void lightkv_close(lightkv *kv) {
     int i;
 
+    // Let the flusher finish pending tickets
+    pthread_mutex_lock(&kv->synclock);
+    kv->flusher_stop = true;
+    pthread_cond_signal(&kv->syncwork);
+    pthread_mutex_unlock(&kv->synclock);
+    if (kv->flusher_on) {
+        pthread_join(kv->flusher, NULL);
+    }
+    pthread_mutex_destroy(&kv->synclock);
+    pthread_cond_destroy(&kv->syncwork);
+    pthread_cond_destroy(&kv->syncdone_cond);
+
+#ifdef USE_MMAP
+    pthread_mutex_lock(&kv->govlock);
+    kv->governor_stop = true;
+    pthread_cond_signal(&kv->govwake);
+    pthread_mutex_unlock(&kv->govlock);
+    if (kv->governor_on) {
+        pthread_join(kv->governor, NULL);
+    }
+    pthread_mutex_destroy(&kv->govlock);
+    pthread_cond_destroy(&kv->govwake);
+#endif
+
+    pthread_mutex_lock(&kv->tierlock);
+    kv->migrator_stop = true;
+    pthread_cond_signal(&kv->tierwake);
+    pthread_mutex_unlock(&kv->tierlock);
+    if (kv->migrator_on) {
+        pthread_join(kv->migrator, NULL);
+    }
+    tier_retire(kv);
+    while (kv->forwarded) {
+        freelist_push(kv, kv->forwarded->l);
+        kv->forwarded = freelist_remove(kv->forwarded, kv->forwarded);
+    }
+    pthread_mutex_destroy(&kv->tierlock);
+    pthread_rwlock_destroy(&kv->movelock);
+    pthread_cond_destroy(&kv->tierwake);
+
+    // Threads still holding an arena of this handle must not touch it.
+    // Slots arenas kept go back to the freelists to be recorded.
+    pthread_key_delete(kv->arenakey);
+    while (kv->arenas) {
+        arena *a = kv->arenas;
+        kv->arenas = a->next;
+        arena_retire(kv, a);
+        for (i=0; i < MAX_SIZES; i++) {
+            while (a->cache[i]) {
+                freelist_push(kv, a->cache[i]->l);
+                a->cache[i] = freelist_remove(a->cache[i], a->cache[i]);
+            }
+        }
+        while (a->limbo) {
+            freelist_push(kv, a->limbo->l);
+            a->limbo = freelist_remove(a->limbo, a->limbo);
+        }
+        free(a->buf);
+        pthread_mutex_destroy(&a->lock);
+        free(a);
+    }
+    pthread_mutex_destroy(&kv->arenalock);
+
+    // Files of another format, or ones init gave up on, are left untouched
+    if (kv->has_scanned) {
+        sync_files(kv);
+        write_super(kv, kv->end_loc, true);
+    }
+
+    // Keep a non empty log around for the next open
+    if (kv->walfd >= 0) {
+        wal_write(kv);
+        close(kv->walfd);
+        if (kv->wallsn < kv->walstart) {
+            char *f = getwalpath(kv->basepath, kv->walgen);
+            unlink(f);
+            free(f);
+        }
+        free(kv->walbuf);
+    }
+    pthread_mutex_destroy(&kv->wallock);
+    pthread_mutex_destroy(&kv->walsynclock);
+    pthread_mutex_destroy(&kv->ckptlock);
+    pthread_rwlock_destroy(&kv->batchlock);
+
     for (i=0; i < MAX_SIZES; i++) {
         freeloc *f = kv->freelist[i];
         while (f) {
+            freeloc *next = f->next;
             free(f);
-            f = freelist_remove(kv->freelist[i], f);
+            f = next;
         }
+        pthread_mutex_destroy(&kv->freelocks[i]);
     }
+    pthread_mutex_destroy(&kv->filelock);
 
     for (i=0; i < kv->nfiles; i++) {
 #ifdef USE_MMAP
@@ -501,5 +4918,29 @@ void lightkv_close(lightkv *kv) {
 #endif
     }
 
+    for (i=0; i < MAX_DICTS; i++) {
+        if (kv->dicts[i]) {
+            free(kv->dicts[i]->data);
+            free(kv->dicts[i]->table);
+            free(kv->dicts[i]);
+        }
+    }
+    pthread_mutex_destroy(&kv->dictlock);
+
+    for (i = -1; i < WHEEL_LEVELS * WHEEL_SLOTS; i++) {
+        expent *e = i < 0 ? kv->due : kv->wheel[i / WHEEL_SLOTS][i % WHEEL_SLOTS];
+        while (e) {
+            expent *next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    pthread_mutex_destroy(&kv->wheellock);
+
+    free(kv->changes);
+    free(kv->heat);
+    free(kv->tierq);
+    cache_free(kv);
+    free((char *) kv->basepath);
     free(kv);
 }
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #define MAX_NFILES       50
 #define MAX_SIZES        20
@@ -11,13 +12,105 @@
 #define MAX_RECORD_SIZE  33554432
 #define MAX_FILESIZE     1073741824
 
-#define RECORD_HEADER_SIZE 8
+#define RECORD_HEADER_SIZE 16
+
+// On disk format, bumped when data files change incompatibly. Kept in the
+// first byte of every data file.
+#define LIGHTKV_FORMAT_VERSION 2
+
+// Per thread allocation arenas
+#define ARENA_CHUNK      1048576 // Default chunk reserved from the tail
+#define ARENA_ALIGN      4096 // Chunk size granularity
+#define ARENA_CACHE_MAX  64 // Free slots cached per size class
+#define ARENA_MAXFRAC    4 // Records above chunksize/ARENA_MAXFRAC skip arenas
+#define EPOCH_BATCH      64 // Deleted slots quarantined before a reclaim pass
+
+// Write ahead log
+#define WAL_BUFSIZE      1048576 // Log bytes buffered before a write
+
+// Durability levels of writes with the write ahead log enabled
+#define LIGHTKV_DURABLE_DEFAULT -1 // Use the level of the handle
+#define LIGHTKV_DURABLE_NONE     0 // Logged in memory, lost on a crash
+#define LIGHTKV_DURABLE_OS       1 // Handed to the OS, survives a process crash
+#define LIGHTKV_DURABLE_SYNC     2 // Fsynced, survives a power loss
+
+// Change feed
+#define CHANGE_BUSY      UINT64_MAX
+
+// Memory governor of mmap mode
+#define GOVERN_GRAIN     67108864 // Region tracked for residency and use
+#define GOVERN_REGIONS   (MAX_FILESIZE / GOVERN_GRAIN)
+#define GOVERN_INTERVAL  1000 // Milliseconds between passes
+#define GOVERN_COLD      10 // Passes unused before a region is deactivated
+#define GOVERN_LOW       90 // Percent of the budget an over budget pass reclaims to
+
+// Hot/cold tiering
+#define TIER_SAMPLE      16 // One in every N reads of a thread is counted, a power of two
+#define TIER_HEATBITS    16 // Log2 of the access counters, indexed by a hash of the recid
+#define TIER_HOT         4 // Every N counts queue the record for the migrator
+#define TIER_QUEUE       4096 // Recids waiting for the migrator, the oldest are dropped
+#define TIER_INTERVAL    1000 // Milliseconds between migrator passes
+#define TIER_GRAIN       1048576 // Granularity of the map of chunks holding moved records
+#define TIER_WORDS       (MAX_FILESIZE / TIER_GRAIN / 64)
+
+// Record expiry
+#define WHEEL_BITS       6
+#define WHEEL_SLOTS      (1 << WHEEL_BITS) // Slots of a timer wheel level
+#define WHEEL_LEVELS     4 // Level n slots span WHEEL_SLOTS^n seconds, later expiries wait at the top
+#define EXPIRE_STEP      8 // Expired records reclaimed on the way by a write
+
+// Record cache
+#define CACHE_SHARDS     16
+#define CACHE_SMALLFRAC  10 // Percent of a shard for records seen once
+#define CACHE_MAXFREQ    3
+#define CACHE_SMALL      0
+#define CACHE_MAIN       1
+#define CACHE_GHOST      2 // Recids evicted from the small queue, no data
+
+// Compression dictionaries
+#define MAX_DICTS        256 // Ids fit the high byte of record flags, 0 is none
+#define DICT_MAXVALUE    4096 // Largest value compressed against a dictionary
+
+// Read size used by recovery scans
+#define RECOVER_READSIZE 4194304
+#define RECOVER_THREADS  4 // Scan workers when open finds no usable superblock
+
+// Read window of an iterator in fd mode
+#define SCAN_READSIZE    2097152
+
+// Granularity of known record starts used to split scans
+#define SPLIT_GRAIN      16777216
+#define SPLITS_PER_FILE  (MAX_FILESIZE / SPLIT_GRAIN)
+
+// Granularity of dirty tracking for sync, a multiple of the page size
+#define DIRTY_GRAIN      65536
+#define DIRTY_WORDS      (MAX_FILESIZE / DIRTY_GRAIN / 64)
 
 #define RECORD_NULL 0
 #define RECORD_VAL  1
 #define RECORD_DEL  2
 #define RECODE_END  3
 
+// Record flags
+#define RECORD_COMPRESSED 0x1 // Value is a u32 raw length and an lz block
+#define RECORD_EXPIRES    0x2 // Key is followed by a u32 expiry time, in seconds since the epoch
+#define RECORD_DICTSHIFT  8
+#define RECORD_DICTMASK   0xff00 // Id of the dictionary a compressed value needs, 0 for none
+#define RECORD_FLAGS      (RECORD_COMPRESSED | RECORD_EXPIRES | RECORD_DICTMASK) // All flags known
+#define RECORD_DICTID(flags) (((flags) & RECORD_DICTMASK) >> RECORD_DICTSHIFT)
+
+// Iterator modes
+#define LIGHTKV_SCAN_FULL    0 // Keys and values
+#define LIGHTKV_SCAN_KEYS    1 // Keys and value lengths
+#define LIGHTKV_SCAN_HEADERS 2 // Recids and value lengths only, key is NULL
+#define SCAN_PEEK            512 // Read per record by scans without values, covers the largest key
+
+// Record checksum verification on read
+#define LIGHTKV_VERIFY_NEVER   0
+#define LIGHTKV_VERIFY_GET     1 // Every lightkv_get
+#define LIGHTKV_VERIFY_SCAN    2 // Every record returned by lightkv_next
+#define LIGHTKV_VERIFY_SAMPLED 4 // One in every N reads of either
+
 // Use mmaping
 //#define USE_MMAP 1
 
@@ -30,11 +123,62 @@ typedef struct __attribute__((__packed__)) {
     // header starts
     uint8_t     type; // type of record
     uint8_t     extlen; // extra length - key size
-    uint16_t    seqno; // future journaling stuff
+    uint16_t    flags; // RECORD_* flags
     uint32_t    len;  // total size of record
+    uint32_t    crc; // CRC32C of the record skipping this field, header only for markers
+    uint32_t    seqno; // Low 32 bits of the change sequence number, 0 for none
     // header ends
 } record;
 
+// Loaded dictionary
+typedef struct {
+    uint32_t    len;
+    char        *data;
+    uint32_t    *table; // Match table of lz_dict_table
+} lzdict;
+
+// Pending expiry of a record in the timer wheel
+typedef struct _expent {
+    uint64_t    recid;
+    uint32_t    expiry; // Seconds since the epoch
+    struct _expent *next;
+} expent;
+
+// Slot of the change feed ring, seqno is published last
+typedef struct {
+    uint64_t    seqno; // 0 when empty, CHANGE_BUSY while being written
+    uint64_t    recid;
+    uint8_t     type;
+} changeslot;
+
+// Cached record, or the ghost of one
+typedef struct _cacheent {
+    uint64_t    recid;
+    record      *rec; // NULL for a ghost
+    uint32_t    size; // Bytes charged to the shard
+    uint8_t     freq; // Hits while queued, upto CACHE_MAXFREQ
+    uint8_t     queue; // CACHE_SMALL, CACHE_MAIN or CACHE_GHOST
+    struct _cacheent *hnext; // Hash chain
+    struct _cacheent *prev, *next; // Queue, newest at head
+} cacheent;
+
+typedef struct {
+    cacheent    *head, *tail;
+    uint64_t    bytes;
+    uint64_t    count;
+} cachequeue;
+
+// Shard of the record cache, evicting with S3-FIFO
+typedef struct __attribute__((aligned(64))) {
+    pthread_mutex_t lock;
+    cacheent    **table;
+    uint64_t    tmask; // Buckets - 1
+    cachequeue  q[3];
+    uint64_t    budget; // Bytes of records kept
+    uint64_t    inval; // Bumped by every invalidation
+    uint64_t    hits, misses;
+} cacheshard;
+
 // Location
 typedef union {
     struct __attribute__((__packed__)) {
@@ -49,6 +193,7 @@ typedef union {
 // TODO: Replace with a rbtree to ensure O(logn) and improve fragmentation
 typedef struct _freeloc {
     loc l;
+    uint64_t epoch; // Reclamation epoch the slot was freed in
     struct _freeloc *prev, *next;
 } freeloc;
 
@@ -60,18 +205,132 @@ freeloc *freelist_get(freeloc *head, uint32_t size);
 
 freeloc *freelist_remove(freeloc *head, freeloc *f);
 
+struct _lightkv;
+
+// Write of an atomic batch, an image of len bytes to put at l
 typedef struct {
+    loc         l;
+    record      *rec;
+    uint32_t    len;
+    uint32_t    seq; // Order within the batch, later writes win
+    bool        fresh; // Slot was allocated by the batch
+    bool        release; // Slot is freed once the batch is applied
+} batchop;
+
+// Per thread allocation arena, padded to keep owners off each others lines
+typedef struct __attribute__((aligned(64))) _arena {
+    struct _lightkv *kv;
+    pthread_mutex_t lock;
+    loc         base; // Start of the reserved chunk
+    uint32_t    cap; // Chunk size, 0 when there is no chunk
+    uint32_t    used; // Bytes carved out of the chunk
+    char        *buf; // In memory copy of the chunk when buffering writes
+    uint32_t    dirty_lo, dirty_hi; // Part of buf not yet written
+    freeloc     *cache[MAX_SIZES]; // Free slots owned by this arena
+    uint32_t    ncache[MAX_SIZES];
+    freeloc     *limbo; // Deleted slots waiting for readers to move on
+    uint32_t    nlimbo;
+    uint64_t    active; // Epoch the owner is reading in, 0 when quiescent
+    uint32_t    readdepth; // Nesting of lightkv_read_begin
+    int         durability; // Level for writes of the owner, or LIGHTKV_DURABLE_DEFAULT
+    uint32_t    nverify; // Reads since the last sampled verification
+    uint32_t    tierrand; // Xorshift state picking the reads tiering counts
+    bool        inuse; // Attached to a thread
+    struct _arena *next; // All arenas of a handle
+} arena;
+
+// Called by the migrator with the old and new recid of a record it moved
+typedef void (*lightkv_moved)(uint64_t from, uint64_t to, void *ctx);
+
+typedef struct _lightkv {
     uint16_t    version; // Lightkv version
     const char  *basepath; // Base db directory path
 #ifdef USE_MMAP
     void        *filemaps[MAX_NFILES]; // Pointer to file mmaps
 #else
-    int         fds[MAX_SIZES];
+    int         fds[MAX_NFILES];
 #endif
     uint16_t    nfiles; // Currently initialized max files
     bool        prealloc; // Need pre-file allocation
     loc         start_loc, end_loc; // Location reference to start and current end
+    pthread_mutex_t filelock; // Serializes creation of data files
     freeloc     *freelist[MAX_SIZES]; // Slab allocation list
+    pthread_mutex_t freelocks[MAX_SIZES]; // Per size class freelist locks
+    pthread_key_t arenakey; // Arena of the calling thread
+    pthread_mutex_t arenalock; // Guards attaching arenas to threads
+    arena       *arenas; // All arenas, only ever grows while open
+    uint32_t    chunksize; // Size of chunks reserved by arenas
+    bool        buffered; // Arenas buffer their chunks in memory
+    uint64_t    epoch; // Global epoch for reclaiming deleted slots
+    uint32_t    splits[MAX_NFILES][SPLITS_PER_FILE]; // A record start per grain, 0 if unknown
+    uint64_t    dirty[MAX_NFILES][DIRTY_WORDS]; // Grains written since the last sync
+    pthread_t   flusher; // Group commit thread, started by the first async sync
+    bool        flusher_on, flusher_stop;
+    pthread_mutex_t synclock; // Guards the sync tickets below
+    pthread_cond_t syncwork, syncdone_cond;
+    uint64_t    syncreq; // Last ticket handed out
+    uint64_t    syncdone; // All tickets upto this one are durable
+    int         walfd; // Current write ahead log, -1 when disabled
+    int         walgen; // Generation of the current log
+    int         durability; // Default level of writes
+    pthread_mutex_t wallock; // Guards appending to the log
+    pthread_mutex_t walsynclock; // One log fsync at a time
+    pthread_mutex_t ckptlock; // One checkpoint at a time
+    pthread_rwlock_t batchlock; // Held shared by batches from logging till applied
+    char        *walbuf; // Entries not yet written
+    uint32_t    wallen;
+    uint64_t    wallsn; // Last lsn handed out
+    uint64_t    walstart; // First lsn of the current log
+    uint64_t    walwritten; // Last lsn handed to the OS
+    uint64_t    walsynced; // Last lsn on disk
+    bool        walfailed; // A log write failed, nothing is logged till the next log
+    int         walreplayed; // Entries replayed at open
+    uint64_t    seqno; // Last change sequence number handed out
+    changeslot  *changes; // Ring of recent changes, NULL when off
+    uint64_t    changemask; // Ring size - 1
+    uint64_t    changestart; // First seqno the ring can hold
+    cacheshard  *cache; // Record cache, NULL when off
+#ifdef USE_MMAP
+    uint32_t    touched[MAX_NFILES][GOVERN_REGIONS]; // Governor pass a region was last used in
+    uint64_t    resident[MAX_NFILES][GOVERN_REGIONS]; // Resident bytes as of the last pass
+    size_t      membudget; // Resident mapped bytes to stay under, 0 for no limit
+    uint32_t    govtick; // Governor passes so far
+    pthread_t   governor; // Started by lightkv_set_membudget
+    bool        governor_on, governor_stop;
+    pthread_mutex_t govlock;
+    pthread_cond_t govwake;
+#endif
+    uint8_t     *heat; // Access counters of tiering, NULL when off
+    uint64_t    *tierq; // Ring of recids queued for the migrator
+    uint64_t    tierhead; // Recids queued so far
+    uint64_t    tiertail; // Recids taken by the migrator so far
+    uint64_t    hotmap[MAX_NFILES][TIER_WORDS]; // Grains holding chunks of moved records
+    loc         tierbase; // Chunk records are moved into
+    uint32_t    tiercap, tierused; // Size of the chunk, 0 when there is none, and bytes used
+    uint64_t    tiermoved; // Records moved so far
+    freeloc     *forwarded; // Slots records were moved out of, not reused till close
+    lightkv_moved moved; // Told of every move, NULL when the migrator is off
+    void        *movedctx;
+    uint32_t    tierinterval; // Milliseconds between migrator passes, 0 for no migrator
+    pthread_t   migrator; // Started by lightkv_set_tiering
+    bool        migrator_on, migrator_stop;
+    pthread_mutex_t tierlock; // One migrator pass at a time
+    pthread_rwlock_t movelock; // Shared by writes to existing slots, the migrator deletes originals exclusive
+    pthread_cond_t tierwake;
+    expent      *wheel[WHEEL_LEVELS][WHEEL_SLOTS]; // Expiries still to come, by second
+    expent      *due; // Expiries whose second has come, reclaimed a few at a time
+    uint32_t    wheelnow; // Second the wheel was advanced to
+    uint64_t    nexpiring; // Entries in the wheel and due
+    uint64_t    nexpired; // Records reclaimed on expiry so far
+    pthread_mutex_t wheellock;
+    uint64_t    memresident; // Resident mapped bytes as of the last pass
+    uint64_t    memreclaimed; // Bytes advised out so far
+    uint32_t    compress_min; // Smallest value tried compressed, 0 when off
+    lzdict      *dicts[MAX_DICTS]; // Dictionaries by id, never replaced while open
+    uint8_t     dictid; // Dictionary new values are compressed with, 0 for none
+    pthread_mutex_t dictlock; // One training at a time
+    int         verify; // LIGHTKV_VERIFY_* flags
+    uint32_t    verify_every; // Sampling rate of LIGHTKV_VERIFY_SAMPLED
     int         error; // err num
     bool        has_scanned;
 } lightkv;
@@ -94,17 +353,32 @@ int read_record(lightkv *kv, loc l, record **rec);
 // Read record header from a location
 record read_recheader(lightkv *kv, loc l);
 
-// Create a record
-record *create_record(uint8_t type, const char *key, const char *val, size_t len, size_t recsize);
+// Create a record stamped with seqno
+record *create_record(uint8_t type, const char *key, const char *val, size_t len, size_t recsize, uint64_t seqno);
 
 // Find or create a free loc to store record of given size
 loc find_freeloc(lightkv *kv, size_t size);
 
 // Public methods
-
-// Initialize db
+//
+// A lightkv handle can be shared between threads. Reads are lock free.
+// Each writer thread allocates from its own arena, which carves chunks
+// reserved atomically from the tail and caches freed slots. Arenas exchange
+// slots with the global freelists, which are locked per size class. Setup
+// calls (lightkv_set_*) and lightkv_close are not thread safe.
+
+// Initialize db. After a clean close the superblock restores end of db and
+// free slots. Otherwise only records after the last checkpoint are scanned;
+// slots freed before that are found by lightkv_recover. Without a superblock,
+// or with one that fails its checks, all data files are scanned. Returns -1
+// with the error set when the files are of another version or a log could
+// not be replayed; lightkv_close then leaves them as they are.
 int lightkv_init(lightkv **kv, const char *base, bool prealloc);
 
+// Rebuild freelists and end of db, scanning all data files in parallel
+// with upto nthreads workers
+int lightkv_recover(lightkv *kv, int nthreads);
+
 // Has error occured?
 bool lightkv_has_error(lightkv *kv);
 
@@ -114,33 +388,293 @@ char *lightkv_errorstr(lightkv *kv);
 // Insert
 uint64_t lightkv_insert(lightkv *kv, const char *key, const char *val, uint32_t len);
 
-// Update
+// Insert n records in one go, recids are returned in input order
+bool lightkv_insert_batch(lightkv *kv, const char **keys, const char **vals, const uint32_t *lens, size_t n, uint64_t *recids);
+
+// Update, returns the recid of the record. It changes when the record
+// moves to another slot, which it always does with the write ahead log on.
 uint64_t lightkv_update(lightkv *kv, uint64_t recid, const char *key, const char *val, uint32_t len);
 
+// Insert a record which expires ttl seconds from now, 0 for never. From
+// then on it reads as missing and the space is reclaimed by following
+// writes, EXPIRE_STEP records at a time, or by lightkv_expire.
+uint64_t lightkv_insert_ttl(lightkv *kv, const char *key, const char *val, uint32_t len, uint32_t ttl);
+
+// Update a record to expire ttl seconds from now, 0 for never. Updates
+// without a ttl take the expiry away.
+uint64_t lightkv_update_ttl(lightkv *kv, uint64_t recid, const char *key, const char *val, uint32_t len, uint32_t ttl);
+
 // Delete
 bool lightkv_delete(lightkv *kv, uint64_t recid);
 
+// Atomic write batch, built and committed by one thread
+typedef struct {
+    lightkv     *store;
+    batchop     *ops;
+    size_t      nops, cap;
+} lightkv_batch;
+
+// Start a batch. Its writes reach the db together on commit: they are
+// logged as one group with a single flush, so the write ahead log has to be
+// on, with lightkv_set_wal before writers start; commits fail otherwise. A
+// crash either applies all of a committed batch or none of it; the
+// durability level decides which failures a commit survives, a process
+// crash atleast.
+lightkv_batch *lightkv_batch_begin(lightkv *kv);
+
+// Add an insert, returns the recid the record will have
+uint64_t lightkv_batch_put(lightkv_batch *b, const char *key, const char *val, uint32_t len);
+
+// Add an update, returns the recid the record will have
+uint64_t lightkv_batch_update(lightkv_batch *b, uint64_t recid, const char *key, const char *val, uint32_t len);
+
+// Add a delete
+bool lightkv_batch_delete(lightkv_batch *b, uint64_t recid);
+
+// Apply and free the batch, false if it could not be logged, or there is no
+// log, and was dropped. Also false with LIGHTKV_ERR_WRITE when the data
+// files could not be written; the logged batch is applied at the next open.
+bool lightkv_batch_commit(lightkv_batch *b);
+
+// Drop and free the batch, recids it handed out become invalid
+void lightkv_batch_abort(lightkv_batch *b);
+
 // Get
 bool lightkv_get(lightkv *kv, uint64_t recid, char **key, char **val, uint32_t *len);
 
+// Enter and leave a read side critical section. Slots deleted meanwhile are
+// not reused before the section ends. Sections nest; lightkv_get and
+// lightkv_next use them internally.
+void lightkv_read_begin(lightkv *kv);
+void lightkv_read_end(lightkv *kv);
+
+#ifdef USE_MMAP
+// Zero copy get, key and val point into the mapped file. Must be called
+// inside lightkv_read_begin/end and the pointers are valid till the end.
+// Compressed records cannot be viewed, use lightkv_get for them.
+bool lightkv_get_view(lightkv *kv, uint64_t recid, const char **key, uint8_t *keylen, const char **val, uint32_t *len);
+#endif
+
+// Filter of a scan, given a record where it was read: its header, key and
+// value. The value is decompressed first, and NULL in modes without values.
+typedef bool (*lightkv_filter)(const record *hdr, const char *key, const char *val, uint32_t len, void *ctx);
+
 // Lightkv iterator object
 typedef struct {
     lightkv *store;
     loc     current;
+    loc     stop; // Scan ends before this loc, 0 for the end of db
+    int     mode; // LIGHTKV_SCAN_* parts of records returned
+    char    *buf; // Read window of full scans in fd mode
+    uint16_t bufnum;
+    uint32_t bufoff, buflen; // Window in file bufnum, 0 long when empty
+    lightkv_filter filter; // Records returned, all when NULL
+    void    *ctx;
+    char    *prefix; // Key prefix records returned have, padded for SIMD loads
+    uint8_t prefixlen; // 0 for none
+    char    *scratch; // Values decompressed for the filter
+    uint32_t scratchsize;
 } lightkv_iter;
 
 // Scan whole db
 lightkv_iter *lightkv_iterator(lightkv *kv);
 
+// Scan whole db returning only records filter accepts. It is called on
+// records in the read window or the mapping, before anything is copied.
+lightkv_iter *lightkv_iterator_filtered(lightkv *kv, lightkv_filter filter, void *ctx);
+
+// Scan whole db returning only records whose key starts with len bytes of
+// prefix, compared with SIMD without calling back
+lightkv_iter *lightkv_iterator_prefix(lightkv *kv, const char *prefix, uint8_t len);
+
+// Return only some parts of records, mode is a LIGHTKV_SCAN_* value.
+// Without values, val is NULL and len the value length, and the rest of
+// the records is not read; checksums are not verified then.
+void lightkv_iter_mode(lightkv_iter *iter, int mode);
+
+// Split the db into n disjoint ranges aligned to record starts, each with
+// its own iterator which can be driven from a separate thread. Recovers
+// the db first if it was not scanned yet.
+lightkv_iter **lightkv_iterator_partitions(lightkv *kv, int n);
+
 // Get next item
 bool lightkv_next(lightkv_iter *iter, uint64_t *recid, char **key, char **val, uint32_t *len);
 
+// Record returned by lightkv_next_batch. Key and value point into the scan
+// buffer and are valid till the next call with it; the key is not NUL
+// terminated.
+typedef struct {
+    uint64_t    recid;
+    const char  *key;
+    const char  *val;
+    uint32_t    len;
+    uint8_t     keylen;
+} lightkv_entry;
+
+// Caller owned buffer of lightkv_next_batch, reused across calls
+typedef struct {
+    char        *buf; // Records read by the last call, fd mode only
+    size_t      size;
+    char        *vals; // Values decompressed by the last call
+    size_t      valsize;
+    lightkv_entry *entries; // Filled by the last call
+    int         cap;
+} lightkv_scanbuf;
+
+// New scan buffer reading size bytes at a time, for upto cap entries
+lightkv_scanbuf *lightkv_scanbuf_new(size_t size, int cap);
+
+// Free a scan buffer
+void lightkv_scanbuf_free(lightkv_scanbuf *sb);
+
+// Fill sb->entries with upto max next items, returns how many, 0 at the
+// end. In fd mode this is one read of sb->size bytes, or one small read per
+// large record without values, and there are no allocations per record
+// either way. With USE_MMAP keys and uncompressed
+// values point into the mapped files: call inside lightkv_read_begin/end
+// and they stay valid till its end.
+int lightkv_next_batch(lightkv_iter *iter, lightkv_scanbuf *sb, int max);
+
 // Free iterator
 void lightkv_free_iter(lightkv_iter *iter);
 
+// Free iterators made by lightkv_iterator_partitions
+void lightkv_free_partitions(lightkv_iter **iters, int n);
+
+// A change to the db, in change sequence order
+typedef struct {
+    uint64_t    seqno;
+    uint64_t    recid;
+    uint8_t     type; // RECORD_VAL for an insert or update, RECORD_DEL for a delete
+} lightkv_change;
+
+// Last change sequence number handed out. Every insert, update and delete
+// takes the next one, which is also stamped into its record. They keep
+// increasing across opens; after a crash without the log, in-place writes
+// since the last checkpoint are only accounted for by lightkv_recover.
+uint64_t lightkv_seqno(lightkv *kv);
+
+// Keep the last n changes, rounded up to a power of two, for
+// lightkv_changes. 0 turns the feed off. Writers never wait for consumers;
+// the oldest changes are dropped instead.
+int lightkv_set_changefeed(lightkv *kv, uint32_t n);
+
+// Copy upto max changes after seqno after, in order, and return how many.
+// Changes still being written end the run early. Returns -1 when changes
+// right after after were dropped already or the feed is off; a consumer
+// then takes lightkv_seqno, rescans with an iterator and tails from there.
+int lightkv_changes(lightkv *kv, uint64_t after, lightkv_change *out, int max);
+
+// Log every write to a write ahead log with the given default durability
+// level. Logs left by an earlier run are replayed by lightkv_init, returns
+// the entries replayed then. Writes the log fails for set LIGHTKV_ERR_WAL
+// and return 0 or false: inserts, updates and batches leave nothing behind,
+// a delete caught mid way is applied but not durable. Later writes fail
+// untouched till the next checkpoint starts a new log.
+int lightkv_set_wal(lightkv *kv, int durability);
+
+// Default durability level of writes
+void lightkv_set_durability(lightkv *kv, int level);
+
+// Durability level of following writes of the calling thread,
+// LIGHTKV_DURABLE_DEFAULT goes back to the handle level
+void lightkv_set_thread_durability(lightkv *kv, int level);
+
+// Verify record checksums on reads, mode is a set of LIGHTKV_VERIFY_* flags
+// and every the sampling rate. Failed records are not returned and set
+// LIGHTKV_ERR_CHECKSUM.
+void lightkv_set_verify(lightkv *kv, int mode, uint32_t every);
+
+// CRC32C of buf continuing from crc, 0 to start. Hardware accelerated.
+uint32_t lightkv_crc32c(uint32_t crc, const void *buf, size_t len);
+
+// Compress values of atleast min bytes when that moves the record into a
+// smaller size class, 0 turns it off. Records are flagged, so reads handle
+// either kind whatever the setting.
+void lightkv_set_compression(lightkv *kv, uint32_t min);
+
+// Train a compression dictionary of upto size bytes on the values of
+// upto nsamples records of atmost DICT_MAXVALUE bytes, taken through an
+// iterator, and compress such values against it from now on, whatever
+// the lightkv_set_compression setting. Returns its id, or -1 if there was
+// nothing to train on. The dictionary is saved in the db directory;
+// earlier ones are kept to read records compressed with them, so
+// retraining can happen online, upto MAX_DICTS - 1 times.
+int lightkv_train_dict(lightkv *kv, uint32_t nsamples, uint32_t size);
+
+// Cache upto size bytes of records read by lightkv_get in the fd backend,
+// 0 turns it off. Records hit again are kept over ones read once, and
+// iterators bypass the cache, so scans do not flush it. Not available with
+// USE_MMAP, returns -1 there.
+int lightkv_set_cache(lightkv *kv, size_t size);
+
+// Keep resident pages of the data file mappings under size bytes. A
+// governor thread measures residency with mincore every GOVERN_INTERVAL
+// ms; regions unused for a while are deactivated, and when over budget the
+// least recently used ones are paged out. Mapped data stays in the files,
+// so this only costs page faults later. 0 lifts the limit. mmap mode
+// only, returns -1 otherwise.
+int lightkv_set_membudget(lightkv *kv, size_t size);
+
+// Resident mapped bytes as of the last governor pass and bytes paged out
+void lightkv_mem_stats(lightkv *kv, uint64_t *resident, uint64_t *reclaimed);
+
+// Pack records read often together. One in TIER_SAMPLE lightkv_get calls
+// of a thread is counted against the record read, and every TIER_HOT counts
+// queue it. Every tier interval a migrator thread copies the queued records
+// into chunks of the tail kept for them and deletes the originals,
+// so the working set of a skewed workload packs into few pages and the
+// regions left behind stay cold, for the kernel or the memory governor to
+// reclaim. A move changes the recid of a record: moved is called with both
+// once the original is gone, and the change feed sees an insert and a
+// delete. A move backs off when the record is written while it is copied.
+// While tiering is on, updates and deletes of a recid that no longer holds
+// a record fail, returning 0 or false; a moved record is written through
+// the recid moved reports. Slots records moved out of are not reused till
+// lightkv_close, so an old recid fails for as long as the handle is open.
+// NULL stops counting and moving.
+int lightkv_set_tiering(lightkv *kv, lightkv_moved moved, void *ctx);
+
+// Milliseconds between migrator passes, TIER_INTERVAL by default. With 0
+// lightkv_set_tiering starts no migrator and passes are only run by
+// lightkv_tier_pass. Takes effect when tiering is turned on.
+void lightkv_set_tier_interval(lightkv *kv, uint32_t ms);
+
+// Move the records queued since the last pass and age the access counters,
+// returns the records moved
+int lightkv_tier_pass(lightkv *kv);
+
+// Recids queued for the migrator and records it moved so far
+void lightkv_tier_stats(lightkv *kv, uint64_t *queued, uint64_t *moved);
+
+// Delete upto max records past their expiry, for when writes are too rare
+// to keep up. Returns how many.
+int lightkv_expire(lightkv *kv, int max);
+
+// Records waiting to expire and records reclaimed on expiry so far
+void lightkv_expire_stats(lightkv *kv, uint64_t *pending, uint64_t *expired);
+
+// Hits and misses of lightkv_get in the record cache
+void lightkv_cache_stats(lightkv *kv, uint64_t *hits, uint64_t *misses);
+
+// Buffer consecutive tail inserts of each thread in memory upto size bytes,
+// 0 disables it. A buffer is flushed when full, on sync and when a read
+// touches it.
+int lightkv_set_writebuffer(lightkv *kv, size_t size);
+
 // Fsync
 void lightkv_sync(lightkv *kv);
 
+// Ask the background flusher to make all writes done so far durable and
+// return at once. One flush covers every ticket requested before it starts.
+void lightkv_sync_async(lightkv *kv, uint64_t *ticket);
+
+// Block till ticket is durable
+void lightkv_sync_wait(lightkv *kv, uint64_t ticket);
+
+// Is ticket durable already?
+bool lightkv_is_durable(lightkv *kv, uint64_t ticket);
+
 // Cleanup and close
 void lightkv_close(lightkv *kv);
 
@@ -0,0 +1,347 @@
+#ifndef LZ_H
+#define LZ_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Byte oriented LZ77 codec in the style of LZ4. A block is a run of
+// sequences: a token with the literal count in its high nibble and the
+// match length - LZ_MINMATCH in its low one, longer counts continued in
+// bytes of 255, the literals, then a 16 bit offset back into the output
+// and the match. The last sequence has literals only.
+//
+// With a dictionary the input is coded as if the dictionary came right
+// before it, so matches may reach back into it. lz_train builds one out of
+// samples of the data to be compressed.
+
+#define LZ_MINMATCH 4
+#define LZ_HASHBITS 12
+#define LZ_DICTBITS 15
+#define LZ_MAXOFF   65535
+#define LZ_MAXDICT  32768
+#define LZ_TRAINBITS 16
+#define LZ_TRAINK   8 // Bytes of the windows counted by lz_train
+#define LZ_SEGMENT  64 // Bytes of the dictionary segments lz_train picks
+
+uint32_t lz_compress(const void *src, uint32_t len, void *dst, uint32_t cap);
+bool lz_decompress(const void *src, uint32_t len, void *dst, uint32_t rawlen);
+void lz_dict_table(const void *dict, uint32_t dictlen, uint32_t *table);
+uint32_t lz_compress_dict(const void *src, uint32_t len, const void *dict, uint32_t dictlen,
+        const uint32_t *dtable, void *dst, uint32_t cap);
+bool lz_decompress_dict(const void *src, uint32_t len, const void *dict, uint32_t dictlen,
+        void *dst, uint32_t rawlen);
+uint32_t lz_train(const void *samples, const uint32_t *lens, uint32_t n, void *dict, uint32_t cap);
+
+static uint32_t lz_hash(uint32_t v, int bits) {
+    return (v * 2654435761U) >> (32 - bits);
+}
+
+static unsigned char *lz_putlen(unsigned char *op, uint32_t n) {
+    while (n >= 255) {
+        *op++ = 255;
+        n -= 255;
+    }
+    *op++ = n;
+    return op;
+}
+
+static bool lz_getlen(const unsigned char **ip, const unsigned char *iend, uint32_t *n) {
+    unsigned char b;
+
+    do {
+        if (*ip >= iend || *n > (1U << 30)) {
+            return false;
+        }
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return true;
+}
+
+// Emit a sequence, a match of mlen bytes off back or none if mlen is 0.
+// NULL if it does not fit before oend.
+static unsigned char *lz_sequence(unsigned char *op, unsigned char *oend, const unsigned char *lit,
+        uint32_t nlit, uint32_t off, uint32_t mlen) {
+    uint32_t ml = mlen ? mlen - LZ_MINMATCH : 0;
+
+    if ((uint64_t) (oend - op) < 1 + nlit / 255 + 1 + nlit + 2 + ml / 255 + 1) {
+        return NULL;
+    }
+
+    unsigned char *token = op++;
+    *token = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+    if (nlit >= 15) {
+        op = lz_putlen(op, nlit - 15);
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (mlen) {
+        *op++ = off & 0xff;
+        *op++ = off >> 8;
+        if (ml >= 15) {
+            op = lz_putlen(op, ml - 15);
+        }
+    }
+    return op;
+}
+
+// Positions + 1 of the last occurrence of each hashed 4 bytes of a
+// dictionary, table has 1 << LZ_DICTBITS entries
+void lz_dict_table(const void *dict, uint32_t dictlen, uint32_t *table) {
+    const unsigned char *d = (const unsigned char *) dict;
+    uint32_t i, seq;
+
+    memset(table, 0, sizeof(uint32_t) << LZ_DICTBITS);
+    for (i=0; i + LZ_MINMATCH <= dictlen; i++) {
+        memcpy(&seq, d + i, sizeof(seq));
+        table[lz_hash(seq, LZ_DICTBITS)] = i + 1;
+    }
+}
+
+// Compress len bytes of src into dst against a dictionary of dictlen bytes
+// and its table, dict may be NULL. Returns the compressed size or 0 if it
+// would not fit in cap bytes; gives up early on data that does not compress.
+uint32_t lz_compress_dict(const void *src, uint32_t len, const void *dict, uint32_t dictlen,
+        const uint32_t *dtable, void *dst, uint32_t cap) {
+    const unsigned char *base = (const unsigned char *) src, *ip = base, *anchor = base;
+    const unsigned char *end = base + len, *limit = len > LZ_MINMATCH ? end - LZ_MINMATCH : base;
+    const unsigned char *d = (const unsigned char *) dict;
+    unsigned char *op = (unsigned char *) dst, *oend = op + cap;
+    uint32_t table[1 << LZ_HASHBITS];
+    uint32_t misses = 0;
+
+    memset(table, 0, sizeof(table));
+    while (ip < limit) {
+        uint32_t seq, cand, off = 0;
+        const unsigned char *ref, *rend = end;
+        memcpy(&seq, ip, sizeof(seq));
+        uint32_t h = lz_hash(seq, LZ_HASHBITS);
+        ref = base + table[h];
+        table[h] = ip - base;
+
+        cand = ~seq;
+        if (ref < ip && ip - ref <= LZ_MAXOFF) {
+            memcpy(&cand, ref, sizeof(cand));
+            off = ip - ref;
+            rend = end;
+        }
+        if (cand != seq && d) {
+            // Earlier input missed, try the dictionary
+            uint32_t dpos = dtable[lz_hash(seq, LZ_DICTBITS)];
+            if (dpos && (ip - base) + dictlen - (dpos - 1) <= LZ_MAXOFF) {
+                ref = d + dpos - 1;
+                memcpy(&cand, ref, sizeof(cand));
+                off = (ip - base) + dictlen - (dpos - 1);
+                rend = d + dictlen;
+            }
+        }
+        if (cand != seq) {
+            // Step faster through data without matches
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        const unsigned char *mp = ip + LZ_MINMATCH, *rp = ref + LZ_MINMATCH;
+        while (mp < end && rp < rend && *mp == *rp) {
+            mp++;
+            rp++;
+        }
+        op = lz_sequence(op, oend, anchor, ip - anchor, off, mp - ip);
+        if (op == NULL) {
+            return 0;
+        }
+        ip = anchor = mp;
+    }
+
+    op = lz_sequence(op, oend, anchor, end - anchor, 0, 0);
+    return op ? op - (unsigned char *) dst : 0;
+}
+
+// Compress len bytes of src into dst, see lz_compress_dict
+uint32_t lz_compress(const void *src, uint32_t len, void *dst, uint32_t cap) {
+    return lz_compress_dict(src, len, NULL, 0, NULL, dst, cap);
+}
+
+// Decompress a block made against a dictionary into exactly rawlen bytes
+// at dst, false if it is corrupt
+bool lz_decompress_dict(const void *src, uint32_t len, const void *dict, uint32_t dictlen,
+        void *dst, uint32_t rawlen) {
+    const unsigned char *ip = (const unsigned char *) src, *iend = ip + len;
+    const unsigned char *d = (const unsigned char *) dict;
+    unsigned char *op = (unsigned char *) dst, *oend = op + rawlen;
+    uint32_t i;
+
+    while (ip < iend) {
+        uint32_t token = *ip++;
+        uint32_t nlit = token >> 4, mlen = token & 15;
+
+        if (nlit == 15 && !lz_getlen(&ip, iend, &nlit)) {
+            return false;
+        }
+        if (nlit > (uint64_t) (iend - ip) || nlit > (uint64_t) (oend - op)) {
+            return false;
+        }
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return false;
+        }
+        uint32_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (mlen == 15 && !lz_getlen(&ip, iend, &mlen)) {
+            return false;
+        }
+        mlen += LZ_MINMATCH;
+        uint64_t done = op - (unsigned char *) dst;
+        if (off == 0 || off > done + dictlen || mlen > (uint64_t) (oend - op)) {
+            return false;
+        }
+
+        if (off > done) {
+            // Starts in the dictionary and may run on into the output
+            for (i=0; i < mlen; i++) {
+                int64_t back = (int64_t) off - i;
+                op[i] = back > (int64_t) done ? d[dictlen - (back - done)] : op[-back];
+            }
+            op += mlen;
+            continue;
+        }
+
+        // Overlapping matches repeat the bytes just written
+        const unsigned char *m = op - off;
+        if (off >= mlen) {
+            memcpy(op, m, mlen);
+        } else {
+            for (i=0; i < mlen; i++) {
+                op[i] = m[i];
+            }
+        }
+        op += mlen;
+    }
+
+    return op == oend;
+}
+
+// Decompress a block into exactly rawlen bytes at dst, false if it is corrupt
+bool lz_decompress(const void *src, uint32_t len, void *dst, uint32_t rawlen) {
+    return lz_decompress_dict(src, len, NULL, 0, dst, rawlen);
+}
+
+// Segment of the samples picked by lz_train
+typedef struct {
+    uint64_t    off;
+    uint64_t    score;
+} lz_segment;
+
+static uint32_t lz_window(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 0x9e3779b97f4a7c15ULL) >> (64 - LZ_TRAINBITS);
+}
+
+static int lz_segcmp(const void *a, const void *b) {
+    uint64_t x = ((const lz_segment *) a)->score, y = ((const lz_segment *) b)->score;
+    return x < y ? -1 : x > y;
+}
+
+// Build a dictionary of upto cap bytes out of n samples laid end to end,
+// lens[i] bytes each, returns its size. A cut down COVER: windows of
+// LZ_TRAINK bytes score by the samples they recur in, the samples are split
+// in one epoch per segment and each gives its best scoring segment of
+// LZ_SEGMENT bytes. Windows taken once score nothing after, and the best
+// segments go last, where offsets are shortest.
+uint32_t lz_train(const void *samples, const uint32_t *lens, uint32_t n, void *dict, uint32_t cap) {
+    const unsigned char *s = (const unsigned char *) samples;
+    unsigned char *out = (unsigned char *) dict;
+    uint64_t total = 0, pos = 0, p, e;
+    uint32_t i, j, nsegs = 0, len = 0;
+
+    for (i=0; i < n; i++) {
+        total += lens[i];
+    }
+    if (total <= cap) {
+        memcpy(out, s, total);
+        return total;
+    }
+    if (cap < LZ_SEGMENT) {
+        return 0;
+    }
+
+    // Samples each window was found in, counted once per sample
+    uint32_t *counts = (uint32_t *) calloc(1 << LZ_TRAINBITS, sizeof(uint32_t));
+    uint32_t *seen = (uint32_t *) calloc(1 << LZ_TRAINBITS, sizeof(uint32_t));
+    for (i=0; i < n; i++) {
+        for (j=0; j + LZ_TRAINK <= lens[i]; j++) {
+            uint32_t h = lz_window(s + pos + j);
+            if (seen[h] != i + 1) {
+                seen[h] = i + 1;
+                counts[h]++;
+            }
+        }
+        pos += lens[i];
+    }
+    // Windows of a single sample save nothing
+    for (i=0; i < 1U << LZ_TRAINBITS; i++) {
+        counts[i] = counts[i] ? counts[i] - 1 : 0;
+    }
+
+    uint32_t nepochs = cap / LZ_SEGMENT;
+    uint64_t epoch = total / nepochs;
+    const uint32_t nwin = LZ_SEGMENT - LZ_TRAINK + 1;
+    lz_segment *segs = (lz_segment *) malloc(nepochs * sizeof(lz_segment));
+    for (e=0; e < nepochs; e++) {
+        uint64_t start = e * epoch, stop = e + 1 < nepochs ? start + epoch : total;
+        uint64_t sum = 0, best = 0, bestoff = 0;
+        if (stop - start < LZ_SEGMENT) {
+            continue;
+        }
+
+        // Slide a segment through the epoch, summing the scores of its windows
+        for (j=0; j < nwin; j++) {
+            sum += counts[lz_window(s + start + j)];
+        }
+        for (p=start; ; p++) {
+            if (sum > best) {
+                best = sum;
+                bestoff = p;
+            }
+            if (p + LZ_SEGMENT >= stop) {
+                break;
+            }
+            sum += counts[lz_window(s + p + nwin)];
+            sum -= counts[lz_window(s + p)];
+        }
+        if (best == 0) {
+            continue;
+        }
+
+        for (j=0; j < nwin; j++) {
+            counts[lz_window(s + bestoff + j)] = 0;
+        }
+        segs[nsegs].off = bestoff;
+        segs[nsegs].score = best;
+        nsegs++;
+    }
+
+    qsort(segs, nsegs, sizeof(lz_segment), lz_segcmp);
+    for (i=0; i < nsegs; i++) {
+        memcpy(out + len, s + segs[i].off, LZ_SEGMENT);
+        len += LZ_SEGMENT;
+    }
+
+    free(segs);
+    free(seen);
+    free(counts);
+    return len;
+}
+
+#endif
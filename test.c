@@ -1,22 +1,150 @@
 #include "lightkv.h"
 #include "logger.h"
 #include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <dirent.h>
 
+#define NTHREADS 4
+#define NTHREAD_OPS 10000
+#define NTHREAD_SYNCS 50
+#define NCOLD 2000
+#define NTORN 100
+#define NDOCS 1000
+#define TESTDIR "/tmp/lkvtest/"
+#define DOCFMT "{\"user_id\":%d,\"email\":\"user%d@example.com\",\"roles\":[\"%s\"],\"created_at\":\"2024-02-%02dT10:%02d:00Z\"," \
+    "\"address\":{\"street\":\"%d Main Street\",\"city\":\"Springfield\",\"country\":\"US\"}," \
+    "\"settings\":{\"theme\":\"%s\",\"notifications\":true,\"language\":\"en-US\"},\"score\":%d}"
 
-int main() {
-    lightkv *kv;
-    lightkv_init(&kv,(char *)  "/tmp/", true);
-    uint64_t rid;
-    char *k,*v;
+void *insert_worker(void *arg) {
+    lightkv *kv = (lightkv *) arg;
+    uint64_t rids[NTHREAD_OPS];
+    char key[32], val[32], *k, *v;
     uint32_t l;
     int i;
+
+    for (i=0; i < NTHREAD_OPS; i++) {
+        snprintf(key, sizeof(key), "thr_%p_%d", (void *) &rids, i);
+        snprintf(val, sizeof(val), "val_%d", i);
+        rids[i] = lightkv_insert(kv, key, val, strlen(val));
+    }
+
+    for (i=0; i < NTHREAD_OPS; i++) {
+        snprintf(key, sizeof(key), "thr_%p_%d", (void *) &rids, i);
+        snprintf(val, sizeof(val), "val_%d", i);
+        assert(lightkv_get(kv, rids[i], &k, &v, &l));
+        assert(!strcmp(k, key) && l == strlen(val) && !memcmp(v, val, l));
+        free(k);
+        free(v);
+        if (i % 3 == 0) {
+            lightkv_delete(kv, rids[i]);
+        }
+    }
+
+    return NULL;
+}
+
+// Insert and wait for each write to become durable
+void *durable_worker(void *arg) {
+    lightkv *kv = (lightkv *) arg;
+    uint64_t ticket;
+    int i;
+
+    for (i=0; i < NTHREAD_SYNCS; i++) {
+        lightkv_insert(kv, "sync_key", "durable", 7);
+        lightkv_sync_async(kv, &ticket);
+        lightkv_sync_wait(kv, ticket);
+        assert(lightkv_is_durable(kv, ticket));
+    }
+
+    return NULL;
+}
+
+// Count records of one partition
+void *scan_worker(void *arg) {
+    lightkv_iter *it = (lightkv_iter *) arg;
     uint64_t recid;
-    lightkv_iter *it = lightkv_iterator(kv);
+    char *k, *v;
+    uint32_t l;
+    long n = 0;
+
     while (lightkv_next(it, &recid, &k, &v, &l)) {
         free(k);
         free(v);
+        n++;
     }
 
+    return (void *) n;
+}
+
+// Filter of values over 4KB
+bool big_value(const record *hdr, const char *key, const char *val, uint32_t len, void *ctx) {
+    return len > 4096;
+}
+
+// Moves seen from the migrator
+typedef struct {
+    uint64_t from[16], to[16];
+    int n;
+} movelog;
+
+void note_move(uint64_t from, uint64_t to, void *ctx) {
+    movelog *ml = (movelog *) ctx;
+    if (ml->n < 16) {
+        ml->from[ml->n] = from;
+        ml->to[ml->n] = to;
+    }
+    ml->n++;
+}
+
+// Superblock layout of the first version, a prefix of the current one.
+// Fixed on disk, so it is spelled out here.
+#define SUPER_V1_MAGIC 0x4b56534c
+typedef struct __attribute__((__packed__)) {
+    uint32_t    magic;
+    uint16_t    version;
+    uint16_t    nfiles;
+    uint64_t    end_loc;
+    uint64_t    seqno;
+    uint8_t     clean;
+    uint32_t    counts[MAX_SIZES];
+    uint64_t    freeoff;
+} super_v1;
+
+// Generation of the newest write ahead log in dir
+int last_wal(const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    int gen, last = -1;
+
+    while ((e = readdir(d))) {
+        if (sscanf(e->d_name, "wal.%d.log", &gen) == 1 && gen > last) {
+            last = gen;
+        }
+    }
+    closedir(d);
+    return last;
+}
+
+int main() {
+    lightkv *kv;
+    assert(system("rm -rf " TESTDIR " && mkdir " TESTDIR) == 0);
+    lightkv_init(&kv,(char *)  TESTDIR, true);
+    lightkv_set_writebuffer(kv, 1 << 20);
+    uint64_t rid;
+    char *k,*v;
+    uint32_t l;
+    int i, j;
+    uint64_t recid;
+    lightkv_iter *it;
+    lightkv_recover(kv, 4);
+
     rid = lightkv_insert(kv, "test_key1", "hello", 5);
 
     rid = lightkv_insert(kv, "test_key2", "helli", 5);
@@ -29,15 +157,44 @@ int main() {
     rid = lightkv_update(kv, rid, "test_upd", "updat", 5);
     rid = lightkv_update(kv, rid, "test_update-large", "1234567890", 10);
 
+    const char *bkeys[] = {"batch_key1", "batch_key2", "batch_key3"};
+    const char *bvals[] = {"one", "two", "three-is-longer"};
+    uint32_t blens[] = {3, 3, 15};
+    uint64_t brids[3];
+    lightkv_insert_batch(kv, bkeys, bvals, blens, 3, brids);
+    lightkv_get(kv, brids[2], &k, &v, &l);
+    assert(l == 15 && !memcmp(v, "three-is-longer", 15));
+    free(k);
+    free(v);
+
+    // Slot deleted inside a read section is not handed out before it ends
+    lightkv_read_begin(kv);
+    lightkv_delete(kv, brids[0]);
+    assert(lightkv_insert(kv, "batch_key4", "one", 3) != brids[0]);
+    lightkv_read_end(kv);
+
+    pthread_t threads[NTHREADS];
+    for (i=0; i < NTHREADS; i++) {
+        pthread_create(&threads[i], NULL, insert_worker, kv);
+    }
+    for (i=0; i < NTHREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i=0; i < NTHREADS; i++) {
+        pthread_create(&threads[i], NULL, durable_worker, kv);
+    }
+    for (i=0; i < NTHREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
 
     for (i=0; i < 1 << 25; i++) {
-        char *st = (char *) calloc(10,1);
+        char *st = (char *) calloc(16,1);
         sprintf(st, "key_%d", i);
 
         rid = lightkv_insert(kv, st, (char *) "hell3", 5);
         free(st);
     }
-    lightkv_free_iter(it);
 
 
 
@@ -52,6 +209,631 @@ int main() {
     lightkv_free_iter(it);
     lightkv_close(kv);
     debug_log("read %d items", i);
+
+    // Reopen and recover, all records must still be there
+    lightkv_init(&kv,(char *)  TESTDIR, true);
+    lightkv_recover(kv, 4);
+    it = lightkv_iterator(kv);
+    int n = 0;
+    while (lightkv_next(it, &recid, &k, &v, &l)) {
+        free(k);
+        free(v);
+        n++;
+    }
+    lightkv_free_iter(it);
+    assert(n == i);
+
+    // Partitioned scan sees every record exactly once
+    pthread_t scanners[NTHREADS];
+    lightkv_iter **parts = lightkv_iterator_partitions(kv, NTHREADS);
+    long total = 0;
+    for (j=0; j < NTHREADS; j++) {
+        pthread_create(&scanners[j], NULL, scan_worker, parts[j]);
+    }
+    for (j=0; j < NTHREADS; j++) {
+        void *cnt;
+        pthread_join(scanners[j], &cnt);
+        total += (long) cnt;
+    }
+    lightkv_free_partitions(parts, NTHREADS);
+    assert(total == i);
+    rid = lightkv_insert(kv, "test_key4", "hello", 5);
+    assert(lightkv_get(kv, rid, &k, &v, &l));
+    free(k);
+    free(v);
+
+    lightkv_close(kv);
+
+    // A clean open restores end of db and free slots from the superblock
+    lightkv_init(&kv,(char *)  TESTDIR, true);
+    rid = lightkv_insert(kv, "test_key5", "hello", 5);
+    it = lightkv_iterator(kv);
+    n = 0;
+    while (lightkv_next(it, &recid, &k, &v, &l)) {
+        free(k);
+        free(v);
+        n++;
+    }
+    lightkv_free_iter(it);
+    assert(n == i + 2);
+    lightkv_close(kv);
+
+    // Without a superblock the files are scanned and nothing is overwritten
+    unlink(TESTDIR "super.db");
+    lightkv_init(&kv,(char *)  TESTDIR, true);
+    rid = lightkv_insert(kv, "test_key6", "hello", 5);
+    it = lightkv_iterator(kv);
+    n = 0;
+    while (lightkv_next(it, &recid, &k, &v, &l)) {
+        free(k);
+        free(v);
+        n++;
+    }
+    lightkv_free_iter(it);
+    assert(n == i + 3);
+    lightkv_close(kv);
+
+    // A superblock of the earlier layout, without expiries, still loads
+    int sfd = open(TESTDIR "super.db", O_RDWR);
+    off_t slen = lseek(sfd, 0, SEEK_END);
+    char *sbuf = (char *) malloc(slen);
+    assert(pread(sfd, sbuf, slen, 0) == slen);
+    super_v1 *hdr = (super_v1 *) sbuf;
+    uint64_t freeoff = hdr->freeoff, nfree = 0;
+    for (j=0; j < MAX_SIZES; j++) {
+        nfree += hdr->counts[j];
+    }
+    // Nothing follows the free slots, no expiries are pending
+    assert(freeoff + nfree * sizeof(uint64_t) == (uint64_t) slen);
+    uint64_t seqno = hdr->seqno + 1000000;
+    hdr->magic = SUPER_V1_MAGIC;
+    hdr->seqno = seqno;
+    hdr->freeoff = sizeof(super_v1) + sizeof(uint32_t);
+    uint32_t check = lightkv_crc32c(lightkv_crc32c(0, sbuf, sizeof(super_v1)), sbuf + freeoff, slen - freeoff);
+    assert(ftruncate(sfd, 0) == 0);
+    assert(pwrite(sfd, sbuf, sizeof(super_v1), 0) == sizeof(super_v1));
+    assert(pwrite(sfd, &check, sizeof(check), sizeof(super_v1)) == sizeof(check));
+    assert(pwrite(sfd, sbuf + freeoff, slen - freeoff, hdr->freeoff) == (ssize_t) (slen - freeoff));
+    close(sfd);
+    free(sbuf);
+    lightkv_init(&kv,(char *)  TESTDIR, true);
+    assert(lightkv_seqno(kv) == seqno);
+    lightkv_close(kv);
+
+    // A durable write survives a crash losing its data file write
+    int fds[2];
+    assert(pipe(fds) == 0);
+    if (fork() == 0) {
+        lightkv_init(&kv,(char *)  TESTDIR, true);
+        lightkv_set_wal(kv, LIGHTKV_DURABLE_OS);
+        lightkv_set_thread_durability(kv, LIGHTKV_DURABLE_SYNC);
+        rid = lightkv_insert(kv, "wal_key", "logged", 6);
+        assert(write(fds[1], &rid, sizeof(rid)) == sizeof(rid));
+        _exit(0);
+    }
+    assert(read(fds[0], &rid, sizeof(rid)) == sizeof(rid));
+    wait(NULL);
+
+    loc wl;
+    wl.val = rid;
+    char *wf = (char *) calloc(64, 1);
+    sprintf(wf, TESTDIR "data.%d.db", wl.l.num);
+    int fd = open(wf, O_WRONLY);
+    char zeros[16] = {0};
+    assert(pwrite(fd, zeros, sizeof(zeros), wl.l.offset) == sizeof(zeros));
+    close(fd);
+    free(wf);
+
+    lightkv_init(&kv,(char *)  TESTDIR, true);
+    assert(lightkv_set_wal(kv, LIGHTKV_DURABLE_OS) == 1);
+    assert(lightkv_get(kv, rid, &k, &v, &l));
+    assert(!strcmp(k, "wal_key") && l == 6 && !memcmp(v, "logged", 6));
+    free(k);
+    free(v);
+
+    // Damaged records are caught on read
+    lightkv_set_verify(kv, LIGHTKV_VERIFY_GET, 0);
+    rid = lightkv_insert(kv, "crc_key", "intact", 6);
+    lightkv_sync(kv);
+    assert(lightkv_get(kv, rid, &k, &v, &l));
+    free(k);
+    free(v);
+    wl.val = rid;
+    wf = (char *) calloc(64, 1);
+    sprintf(wf, TESTDIR "data.%d.db", wl.l.num);
+    fd = open(wf, O_WRONLY);
+    assert(pwrite(fd, "X", 1, wl.l.offset + RECORD_HEADER_SIZE + 7) == 1);
+    close(fd);
+    free(wf);
+    assert(!lightkv_get(kv, rid, &k, &v, &l));
+    assert(lightkv_has_error(kv));
+
+    // Writes fail while the log cannot be written, a checkpoint starts anew.
+    // The log the next checkpoint starts is a full device.
+    lightkv_set_thread_durability(kv, LIGHTKV_DURABLE_SYNC);
+    char walpath[64];
+    snprintf(walpath, sizeof(walpath), TESTDIR "wal.%d.log", last_wal(TESTDIR) + 1);
+    assert(symlink("/dev/full", walpath) == 0);
+    assert(lightkv_insert(kv, "wal_ok", "logged", 6) != 0);
+    lightkv_sync(kv);
+    assert(lightkv_insert(kv, "wal_lost", "unlogged", 8) == 0);
+    assert(!strcmp(lightkv_errorstr(kv), "write ahead log could not be written"));
+    assert(!lightkv_delete(kv, rid));
+    lightkv_sync(kv);
+    rid = lightkv_insert(kv, "wal_back", "logged", 6);
+    assert(rid != 0 && lightkv_get(kv, rid, &k, &v, &l));
+    free(k);
+    free(v);
+    lightkv_set_thread_durability(kv, LIGHTKV_DURABLE_DEFAULT);
+    lightkv_close(kv);
+
+#ifndef USE_MMAP
+    // Data file writes that fail are reported, the insert leaves nothing
+    if (fork() == 0) {
+        assert(system("mkdir " TESTDIR "full") == 0);
+        lightkv_init(&kv,(char *)  TESTDIR "full/", false);
+        struct rlimit fsize = { 1 << 20, 1 << 20 };
+        signal(SIGXFSZ, SIG_IGN);
+        assert(setrlimit(RLIMIT_FSIZE, &fsize) == 0);
+        char *big = (char *) malloc(2 << 20);
+        memset(big, 'b', 2 << 20);
+        assert(lightkv_insert(kv, "too_big", big, 2 << 20) == 0);
+        assert(!strcmp(lightkv_errorstr(kv), "data file could not be written"));
+        _exit(0);
+    }
+    int status;
+    wait(&status);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+#endif
+
+    // A crash leaves a damaged record and a torn tail, recovery zeroes the
+    // tail and reports the damage below it
+    uint64_t trids[NTORN];
+    if (fork() == 0) {
+        lightkv_init(&kv,(char *)  TESTDIR, true);
+        for (i=0; i < NTORN; i++) {
+            char key[32];
+            snprintf(key, sizeof(key), "torn_%d", i);
+            trids[i] = lightkv_insert(kv, key, "unsynced", 8);
+        }
+        assert(write(fds[1], trids, sizeof(trids)) == sizeof(trids));
+        _exit(0);
+    }
+    assert(read(fds[0], trids, sizeof(trids)) == sizeof(trids));
+    wait(NULL);
+
+    char junk[RECORD_HEADER_SIZE];
+    memset(junk, 0xff, sizeof(junk));
+    for (i=NTORN / 2; i < NTORN; i += NTORN / 2 - 1) {
+        wl.val = trids[i];
+        wf = (char *) calloc(64, 1);
+        sprintf(wf, TESTDIR "data.%d.db", wl.l.num);
+        fd = open(wf, O_WRONLY);
+        if (i == NTORN - 1) {
+            assert(pwrite(fd, junk, sizeof(junk), wl.l.offset) == sizeof(junk));
+        } else {
+            assert(pwrite(fd, "X", 1, wl.l.offset + RECORD_HEADER_SIZE + 3) == 1);
+        }
+        close(fd);
+        free(wf);
+    }
+
+    lightkv_init(&kv,(char *)  TESTDIR, true);
+    assert(lightkv_has_error(kv));
+    lightkv_set_verify(kv, LIGHTKV_VERIFY_GET, 0);
+    for (i=0; i < NTORN; i++) {
+        bool found = lightkv_get(kv, trids[i], &k, &v, &l);
+        assert(found == (i != NTORN / 2 && i != NTORN - 1));
+        if (found) {
+            free(k);
+            free(v);
+        }
+    }
+    rid = lightkv_insert(kv, "after_torn", "hello", 5);
+    assert(lightkv_get(kv, rid, &k, &v, &l));
+    assert(!strcmp(k, "after_torn"));
+    free(k);
+    free(v);
+    lightkv_close(kv);
+
+    // A batch applies as a whole, also when replayed after a crash
+    lightkv_init(&kv,(char *)  TESTDIR, true);
+    uint64_t bold = lightkv_insert(kv, "batch_old", "stale", 5);
+    uint64_t bidx = lightkv_insert(kv, "batch_idx", "0", 1);
+    lightkv_close(kv);
+    uint64_t arids[2];
+    if (fork() == 0) {
+        lightkv_init(&kv,(char *)  TESTDIR, true);
+        // Batches need the log
+        lightkv_batch *b = lightkv_batch_begin(kv);
+        lightkv_batch_put(b, "batch_nolog", "dropped", 7);
+        assert(!lightkv_batch_commit(b));
+        lightkv_set_wal(kv, LIGHTKV_DURABLE_NONE);
+        lightkv_set_thread_durability(kv, LIGHTKV_DURABLE_SYNC);
+        b = lightkv_batch_begin(kv);
+        arids[0] = lightkv_batch_put(b, "batch_new", "fresh", 5);
+        arids[1] = lightkv_batch_update(b, bidx, "batch_idx", "moved to a bigger slot", 22);
+        lightkv_batch_delete(b, bold);
+        assert(lightkv_batch_commit(b));
+        assert(write(fds[1], arids, sizeof(arids)) == sizeof(arids));
+        _exit(0);
+    }
+    assert(read(fds[0], arids, sizeof(arids)) == sizeof(arids));
+    wait(NULL);
+
+    wl.val = arids[0];
+    wf = (char *) calloc(64, 1);
+    sprintf(wf, TESTDIR "data.%d.db", wl.l.num);
+    fd = open(wf, O_WRONLY);
+    assert(pwrite(fd, zeros, sizeof(zeros), wl.l.offset) == sizeof(zeros));
+    close(fd);
+    free(wf);
+
+    lightkv_init(&kv,(char *)  TESTDIR, true);
+    assert(lightkv_set_wal(kv, LIGHTKV_DURABLE_NONE) == 4);
+    assert(lightkv_get(kv, arids[0], &k, &v, &l));
+    assert(!strcmp(k, "batch_new") && l == 5);
+    free(k);
+    free(v);
+    assert(lightkv_get(kv, arids[1], &k, &v, &l));
+    assert(l == 22 && !memcmp(v, "moved to a bigger slot", 22));
+    free(k);
+    free(v);
+    assert(!lightkv_get(kv, bold, &k, &v, &l));
+    assert(!lightkv_get(kv, bidx, &k, &v, &l));
+
+    // Changes can be tailed from any seqno the feed still holds
+    lightkv_set_changefeed(kv, 4);
+    uint64_t seq = lightkv_seqno(kv);
+    lightkv_change ch[8];
+    assert(seq > 0);
+    // With the log on the update moves, its old slot is deleted after
+    uint64_t first = lightkv_insert(kv, "cdc_key", "v1", 2);
+    rid = lightkv_update(kv, first, "cdc_key", "v2", 2);
+    lightkv_delete(kv, rid);
+    assert(rid != first);
+    assert(lightkv_changes(kv, seq, ch, 8) == 4);
+    assert(ch[0].seqno == seq + 1 && ch[0].recid == first && ch[0].type == RECORD_VAL);
+    assert(ch[1].recid == rid && ch[1].type == RECORD_VAL);
+    assert(ch[2].recid == first && ch[2].type == RECORD_DEL);
+    assert(ch[3].seqno == seq + 4 && ch[3].recid == rid && ch[3].type == RECORD_DEL);
+    assert(lightkv_changes(kv, seq + 1, ch, 1) == 1 && ch[0].seqno == seq + 2);
+    for (i=0; i < 4; i++) {
+        lightkv_insert(kv, "cdc_more", "x", 1);
+    }
+    assert(lightkv_changes(kv, seq, ch, 8) == -1);
+    assert(lightkv_changes(kv, seq + 4, ch, 8) == 4);
+    assert(lightkv_changes(kv, seq + 8, ch, 8) == 0);
+    lightkv_close(kv);
+
+    lightkv_init(&kv,(char *)  TESTDIR, true);
+    assert(lightkv_seqno(kv) == seq + 8);
+
+    // Hot records stay cached through a flood of records read once, the
+    // cache is for the fd backend only
+    uint64_t hot, cold[NCOLD];
+#ifdef USE_MMAP
+    assert(lightkv_set_cache(kv, 65536) == -1);
+#else
+    assert(lightkv_set_cache(kv, 65536) == 0);
+#endif
+    hot = lightkv_insert(kv, "hot_key", "hot", 3);
+    for (i=0; i < NCOLD; i++) {
+        cold[i] = lightkv_insert(kv, "cold_key", "cold", 4);
+    }
+    for (i=0; i < 3; i++) {
+        assert(lightkv_get(kv, hot, &k, &v, &l));
+        free(k);
+        free(v);
+    }
+    for (i=0; i < NCOLD; i++) {
+        assert(lightkv_get(kv, cold[i], &k, &v, &l));
+        free(k);
+        free(v);
+    }
+    assert(lightkv_get(kv, hot, &k, &v, &l));
+    free(k);
+    free(v);
+#ifndef USE_MMAP
+    uint64_t hits, misses;
+    lightkv_cache_stats(kv, &hits, &misses);
+    assert(hits == 3 && misses == NCOLD + 1);
+#endif
+
+    // Writes invalidate
+    hot = lightkv_update(kv, hot, "hot_key", "new", 3);
+    assert(lightkv_get(kv, hot, &k, &v, &l));
+    assert(!memcmp(v, "new", 3));
+    free(k);
+    free(v);
+    lightkv_delete(kv, hot);
+    assert(!lightkv_get(kv, hot, &k, &v, &l));
+
+    // Only mappings have resident pages to govern
+#ifdef USE_MMAP
+    assert(lightkv_set_membudget(kv, 64 << 20) == 0);
+#else
+    assert(lightkv_set_membudget(kv, 64 << 20) == -1);
+#endif
+
+    // Records read often are packed together by the migrator, once
+    movelog ml;
+    uint64_t tiered[8], queued, moved;
+    char tv[8], filler[1000];
+    memset(&ml, 0, sizeof(ml));
+    memset(filler, 'f', sizeof(filler));
+    for (i=0; i < 8; i++) {
+        snprintf(tv, sizeof(tv), "tier%d", i);
+        tiered[i] = lightkv_insert(kv, "tier_key", tv, 5);
+        for (j=0; j < 4; j++) {
+            lightkv_insert(kv, "filler_key", filler, sizeof(filler));
+        }
+    }
+    // Without the migrator thread, passes run here
+    lightkv_set_tier_interval(kv, 0);
+    assert(lightkv_set_tiering(kv, note_move, &ml) == 0);
+    for (j=0; j < 400; j++) {
+        for (i=0; i < 8; i++) {
+            assert(lightkv_get(kv, tiered[i], &k, &v, &l));
+            free(k);
+            free(v);
+        }
+    }
+    assert(lightkv_tier_pass(kv) == 8);
+    assert(ml.n == 8);
+    assert(lightkv_update(kv, tiered[0], "tier_key", "stale", 5) == 0);
+    assert(!lightkv_delete(kv, tiered[0]));
+    loc lo, hi;
+    lo.val = hi.val = ml.to[0];
+    for (i=0; i < 8; i++) {
+        for (j=0; j < 8 && ml.from[j] != tiered[i]; j++);
+        assert(j < 8);
+        assert(!lightkv_get(kv, tiered[i], &k, &v, &l));
+        assert(lightkv_get(kv, ml.to[j], &k, &v, &l));
+        snprintf(tv, sizeof(tv), "tier%d", i);
+        assert(!strcmp(k, "tier_key") && l == 5 && !memcmp(v, tv, 5));
+        free(k);
+        free(v);
+        tiered[i] = ml.to[j];
+        loc to;
+        to.val = ml.to[j];
+        assert(to.l.num == lo.l.num);
+        if (to.l.offset < lo.l.offset) {
+            lo = to;
+        }
+        if (to.l.offset > hi.l.offset) {
+            hi = to;
+        }
+    }
+    assert(hi.l.offset - lo.l.offset == 7 * 32);
+    for (j=0; j < 400; j++) {
+        for (i=0; i < 8; i++) {
+            assert(lightkv_get(kv, tiered[i], &k, &v, &l));
+            free(k);
+            free(v);
+        }
+    }
+    assert(lightkv_tier_pass(kv) == 0);
+    lightkv_tier_stats(kv, &queued, &moved);
+    assert(ml.n == 8 && moved == 8 && queued > 8);
+    lightkv_set_tiering(kv, NULL, NULL);
+
+    // Expired records read as missing, also from the cache, and the next
+    // write reclaims them
+    uint64_t pending, expired;
+    uint64_t eph = lightkv_insert_ttl(kv, "ttl_key", "gone", 4, 1);
+    uint64_t kept = lightkv_insert_ttl(kv, "ttl_kept", "kept", 4, 3600);
+    for (i=0; i < 2; i++) {
+        assert(lightkv_get(kv, eph, &k, &v, &l));
+        assert(!strcmp(k, "ttl_key") && l == 4 && !memcmp(v, "gone", 4));
+        free(k);
+        free(v);
+    }
+    sleep(2);
+    assert(!lightkv_get(kv, eph, &k, &v, &l));
+    lightkv_insert(kv, "ttl_nudge", "n", 1);
+    lightkv_expire_stats(kv, &pending, &expired);
+    assert(pending == 1 && expired == 1);
+    loc el;
+    el.val = eph;
+    assert(read_recheader(kv, el).type == RECORD_DEL);
+    assert(lightkv_get(kv, kept, &k, &v, &l));
+    assert(l == 4 && !memcmp(v, "kept", 4));
+    free(k);
+    free(v);
+    kept = lightkv_update(kv, kept, "ttl_kept", "held", 4);
+    assert(lightkv_get(kv, kept, &k, &v, &l) && !memcmp(v, "held", 4));
+    free(k);
+    free(v);
+
+    // Values compressed across a size class boundary read back the same
+    char *json = (char *) malloc(5000), *noise = (char *) malloc(5000);
+    for (i=0; i < 5000; i++) {
+        json[i] = "{\"id\":12,\"name\":\"lightkv\"},"[i % 27];
+        noise[i] = rand();
+    }
+    lightkv_set_compression(kv, 64);
+    loc cl;
+    cl.val = lightkv_insert(kv, "json_key", json, 5000);
+    assert((1 << (cl.l.sclass + FIRST_SIZECLASS)) <= 4096);
+    for (i=0; i < 2; i++) {
+        assert(lightkv_get(kv, cl.val, &k, &v, &l));
+        assert(!strcmp(k, "json_key") && l == 5000 && !memcmp(v, json, 5000));
+        free(k);
+        free(v);
+    }
+    json[0] = '[';
+    assert(lightkv_update(kv, cl.val, "json_key", json, 5000) == cl.val);
+    assert(lightkv_get(kv, cl.val, &k, &v, &l));
+    assert(l == 5000 && !memcmp(v, json, 5000));
+    free(k);
+    free(v);
+    cl.val = lightkv_insert(kv, "noise_key", noise, 5000);
+    assert((1 << (cl.l.sclass + FIRST_SIZECLASS)) == 8192);
+    assert(lightkv_get(kv, cl.val, &k, &v, &l));
+    assert(l == 5000 && !memcmp(v, noise, 5000));
+    free(k);
+    free(v);
+    free(json);
+    free(noise);
+
+    // Batched scans see what lightkv_next does, through a buffer smaller
+    // than some records
+    lightkv_scanbuf *sb = lightkv_scanbuf_new(4096, 16);
+    lightkv_iter *bit = lightkv_iterator(kv);
+    it = lightkv_iterator(kv);
+    int nb;
+    total = 0;
+    lightkv_read_begin(kv);
+    while ((nb = lightkv_next_batch(bit, sb, 16)) > 0) {
+        for (i=0; i < nb; i++) {
+            lightkv_entry *e = &sb->entries[i];
+            assert(lightkv_next(it, &recid, &k, &v, &l));
+            assert(recid == e->recid && l == e->len && !memcmp(v, e->val, l));
+            assert(strlen(k) == e->keylen && !memcmp(k, e->key, e->keylen));
+            free(k);
+            free(v);
+        }
+        total += nb;
+    }
+    lightkv_read_end(kv);
+    assert(!lightkv_next(it, &recid, &k, &v, &l));
+    assert(total > NCOLD);
+    lightkv_free_iter(it);
+    lightkv_free_iter(bit);
+
+    // Key and header scans give the same recids and value lengths
+    bit = lightkv_iterator(kv);
+    it = lightkv_iterator(kv);
+    lightkv_iter_mode(bit, LIGHTKV_SCAN_KEYS);
+    lightkv_iter_mode(it, LIGHTKV_SCAN_HEADERS);
+    while ((nb = lightkv_next_batch(bit, sb, 16)) > 0) {
+        for (i=0; i < nb; i++) {
+            lightkv_entry *e = &sb->entries[i];
+            assert(lightkv_next(it, &recid, &k, &v, &l));
+            assert(recid == e->recid && l == e->len && k == NULL && v == NULL);
+            assert(e->key && e->val == NULL);
+        }
+        total -= nb;
+    }
+    assert(!lightkv_next(it, &recid, &k, &v, &l));
+    assert(total == 0);
+    lightkv_free_iter(it);
+    lightkv_free_iter(bit);
+
+    // Filtered scans return only what matches, however they are driven
+    char pkey[64];
+    for (i=0; i < 3; i++) {
+        snprintf(pkey, sizeof(pkey), "prefix_scan_long_key_%d", i);
+        lightkv_insert(kv, pkey, "p", 1);
+    }
+    int ncold = 0, nbig = 0;
+    it = lightkv_iterator(kv);
+    while (lightkv_next(it, &recid, &k, &v, &l)) {
+        ncold += !strncmp(k, "cold_", 5);
+        nbig += l > 4096;
+        free(k);
+        free(v);
+    }
+    lightkv_free_iter(it);
+    assert(ncold == NCOLD && nbig >= 2);
+
+    it = lightkv_iterator_prefix(kv, "cold_", 5);
+    for (i=0; lightkv_next(it, &recid, &k, &v, &l); i++) {
+        assert(!strcmp(k, "cold_key") && l == 4 && !memcmp(v, "cold", 4));
+        free(k);
+        free(v);
+    }
+    lightkv_free_iter(it);
+    assert(i == ncold);
+    it = lightkv_iterator_prefix(kv, "prefix_scan_long_key_", 21);
+    for (i=0; (nb = lightkv_next_batch(it, sb, 16)) > 0; i += nb);
+    lightkv_free_iter(it);
+    assert(i == 3);
+    it = lightkv_iterator_prefix(kv, "prefix_scan_long_key_1", 22);
+    assert(lightkv_next(it, &recid, &k, &v, &l) && !strcmp(k, "prefix_scan_long_key_1"));
+    free(k);
+    free(v);
+    assert(!lightkv_next(it, &recid, &k, &v, &l));
+    lightkv_free_iter(it);
+
+    it = lightkv_iterator_filtered(kv, big_value, NULL);
+    for (i=0; (nb = lightkv_next_batch(it, sb, 16)) > 0; i += nb) {
+        for (j=0; j < nb; j++) {
+            assert(sb->entries[j].len > 4096);
+        }
+    }
+    lightkv_free_iter(it);
+    assert(i == nbig);
+    lightkv_scanbuf_free(sb);
+    lightkv_close(kv);
+
+    // Small values compress against a dictionary trained on their peers
+    char doc[512];
+    uint64_t docs[NDOCS];
+    int dl;
+    assert(system("rm -rf /tmp/lkvdict && mkdir /tmp/lkvdict") == 0);
+    lightkv_init(&kv,(char *)  "/tmp/lkvdict/", true);
+    for (i=0; i < NDOCS; i++) {
+        dl = snprintf(doc, sizeof(doc), DOCFMT, i * 7919 % 100000, i, i % 3 ? "reader" : "writer",
+                i % 28 + 1, i % 60, i * 13 % 900 + 100, i % 2 ? "dark" : "light", i * 31 % 1000);
+        cl.val = docs[i] = lightkv_insert(kv, "doc", doc, dl);
+        assert((1 << (cl.l.sclass + FIRST_SIZECLASS)) == 512);
+    }
+    assert(lightkv_train_dict(kv, NDOCS, 16384) == 1);
+    dl = snprintf(doc, sizeof(doc), DOCFMT, 4242, 4242, "admin", 7, 42, 512, "dark", 5);
+    cl.val = lightkv_insert(kv, "doc", doc, dl);
+    assert((1 << (cl.l.sclass + FIRST_SIZECLASS)) <= 256);
+    assert(lightkv_get(kv, cl.val, &k, &v, &l));
+    assert(l == (uint32_t) dl && !memcmp(v, doc, dl));
+    free(k);
+    free(v);
+    eph = lightkv_insert_ttl(kv, "ttl_key", "gone", 4, 1);
+    lightkv_close(kv);
+
+    // Dictionaries and pending expiries are loaded at open, retraining keeps
+    // the old dictionaries readable
+    lightkv_init(&kv,(char *)  "/tmp/lkvdict/", true);
+    lightkv_expire_stats(kv, &pending, &expired);
+    assert(pending == 1);
+    sleep(2);
+    assert(!lightkv_get(kv, eph, &k, &v, &l));
+    assert(lightkv_expire(kv, 16) == 1);
+    assert(lightkv_get(kv, cl.val, &k, &v, &l));
+    assert(l == (uint32_t) dl && !memcmp(v, doc, dl));
+    free(k);
+    free(v);
+    assert(lightkv_train_dict(kv, NDOCS, 16384) == 2);
+    assert(lightkv_get(kv, cl.val, &k, &v, &l));
+    assert(l == (uint32_t) dl && !memcmp(v, doc, dl));
+    free(k);
+    free(v);
+    rid = lightkv_update(kv, docs[0], "doc", doc, dl);
+    assert(lightkv_get(kv, rid, &k, &v, &l));
+    assert(l == (uint32_t) dl && !memcmp(v, doc, dl));
+    free(k);
+    free(v);
+
+    // Records larger than a scan window are read on their own
+    char *huge = (char *) malloc(3 << 20);
+    for (i=0; i < 3 << 20; i++) {
+        huge[i] = rand();
+    }
+    lightkv_insert(kv, "huge_key", huge, 3 << 20);
+    it = lightkv_iterator_prefix(kv, "huge", 4);
+    assert(lightkv_next(it, &recid, &k, &v, &l));
+    assert(l == 3 << 20 && !memcmp(v, huge, l));
+    free(k);
+    free(v);
+    lightkv_free_iter(it);
+    sb = lightkv_scanbuf_new(4096, 16);
+    it = lightkv_iterator_prefix(kv, "huge", 4);
+    assert(lightkv_next_batch(it, sb, 16) == 1);
+    assert(sb->entries[0].len == 3 << 20 && !memcmp(sb->entries[0].val, huge, 3 << 20));
+    lightkv_free_iter(it);
+    lightkv_scanbuf_free(sb);
+    free(huge);
+    lightkv_close(kv);
     exit(0);
 
 }
@@ -3,21 +3,51 @@
 #include "sqlite_db.hh"
 #include "timing.hh"
 #include <unistd.h>
+#include <stdlib.h>
 
 #include <vector>
+#include <thread>
+#include <functional>
 
 using namespace std;
 
+#define NUM_OPS 5000000
+#define CRC_BUFSIZE (64 << 20)
+#define CRC_ROUNDS 16
+
+// Run op(i) for i in [0, n) split into contiguous ranges across nthreads
+static void RunParallel(int nthreads, int n, function<void(int)> op) {
+    vector<thread> workers;
+    int t;
+
+    for (t=0; t < nthreads; t++) {
+        int start = (long) n * t / nthreads;
+        int end = (long) n * (t+1) / nthreads;
+        workers.push_back(thread([start, end, &op]() {
+            for (int i=start; i < end; i++) {
+                op(i);
+            }
+        }));
+    }
+
+    for (t=0; t < nthreads; t++) {
+        workers[t].join();
+    }
+}
+
 int main(int argc, char **argv) {
     std::string dbtype("sqlite");
     BaseDB *db;
-    char c;
+    int c, nthreads = 1;
 
-    while ((c = getopt (argc, argv, "d:")) != -1) {
+    while ((c = getopt (argc, argv, "d:t:")) != -1) {
         switch (c) {
             case 'd':
                 dbtype = optarg;
                 break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
         }
     }
 
@@ -27,46 +57,65 @@ int main(int argc, char **argv) {
         db = new LightKVDB("/tmp/");
     } else {
         db = new SqliteDB("/tmp/data.sqlite");
+        // Sqlite handle is used without any locking
+        nthreads = 1;
+    }
+
+    if (nthreads < 1) {
+        nthreads = 1;
     }
+    std::cout<<"Threads:"<<nthreads<<std::endl;
 
-    int i;
-    vector<uint64_t> rids;
-    std::string val("value..........");
+    if (dbtype == "lightkv") {
+        // Record checksums are computed once per insert
+        std::string buf(CRC_BUFSIZE, 'x');
+        uint32_t crc = 0;
+        Timing t("crc32c of 1GB", false);
+        for (int i=0; i < CRC_ROUNDS; i++) {
+            crc = lightkv_crc32c(crc, buf.data(), buf.size());
+        }
+        t.stop();
+        t.display();
+        std::cout<<"crc32c: "<<(double) CRC_BUFSIZE * CRC_ROUNDS / t.getTotalSeconds() / 1e9
+            <<" GB/s ("<<std::hex<<crc<<std::dec<<")"<<std::endl;
+    }
+
+    vector<uint64_t> rids(NUM_OPS);
     {
+        std::string val("value..........");
         Timing t("insert of 5000000");
-        for (i=0; i< 5000000; i++) {
+        RunParallel(nthreads, NUM_OPS, [&](int i) {
             stringstream ss;
             ss<<"key_"<<i;
             std::string k = ss.str();
-            rids.push_back(db->Insert(k, val));
-        }
+            rids[i] = db->Insert(k, val);
+        });
     }
 
     {
-        val = "newvalue";
+        std::string val("newvalue");
         Timing t("update of 5000000");
-        for (i=0; i< 5000000; i++) {
+        RunParallel(nthreads, NUM_OPS, [&](int i) {
             stringstream ss;
             ss<<"key_"<<i;
             std::string k = ss.str();
             db->Update(rids.at(i), k, val);
-        }
+        });
     }
 
     {
         Timing t("Get of 5000000");
-        for (i=0; i< 5000000; i++) {
+        RunParallel(nthreads, NUM_OPS, [&](int i) {
             string k,v;
             db->Get(rids.at(i), k, v);
-        }
+        });
     }
 
     {
         Timing t("Delete of 5000000");
-        for (i=0; i< 5000000; i++) {
-            string k,v;
+        RunParallel(nthreads, NUM_OPS, [&](int i) {
             db->Delete(rids.at(i));
-        }
+        });
     }
 
     return 0;